@@ -0,0 +1,1043 @@
+
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "kernel_cc.h"
+
+
+/**
+	@file kernel_cc.c
+
+	@brief The implementation for concurrency control .
+
+	Locks for scheduler and device drivers. Because we support 
+    multiple cores, we need to avoid race conditions
+    with an interrupt handler on the same core, and also to
+    avoid race conditions between cores.
+  */
+
+
+/* Counters of one lock acquisition, kept with LOCK_PROFILING */
+typedef struct lock_wait {
+	unsigned long spins;
+	unsigned long sleeps;
+} lock_wait;
+
+#ifdef LOCK_PROFILING
+#define LOCKPROF_COUNT(lw, field) do { if(lw) (lw)->field++; } while(0)
+static TimerDuration lockprof_clock();
+static void lockprof_acquired(const char* kind, const char* file, int line, 
+	void* lock, lock_wait* lw, TimerDuration wait);
+static void lockprof_released(void* lock);
+#else
+#define LOCKPROF_COUNT(lw, field) do { } while(0)
+#endif
+
+
+/*
+	Futex wait queues.
+	------------------
+
+	Threads blocked by FutexWait sleep on a wait queue keyed by the address
+	of the futex word. The queues are kept in a small hash table, each bucket 
+	protected by a spinlock which is only locked with preemption off (so it
+	never blocks itself). The check of the futex word and the sleep are done 
+	under the bucket lock, thus a FutexWake on the same address cannot slip
+	between them.
+ */
+
+#define FUTEX_BUCKETS 64
+
+/** \cond HELPER Helper structure for futex waiters. */
+typedef struct __futex_waiter {
+	rlnode node;				/* become part of a bucket list */
+	TCB* thread;				/* thread to wait */
+	void* addr;					/* the futex word waited on */
+	sig_atomic_t woken;			/* this is set if the thread is woken by futex_wake */
+	sig_atomic_t removed;		/* this is set if the waiter is removed from the list */
+} __futex_waiter;
+/** \endcond */
+
+static struct futex_bucket {
+	Mutex lock;
+	rlnode waiters;
+	int spins;			/* spin history of the mutexes hashed here */
+} futex_table[FUTEX_BUCKETS];
+
+/* Return the bucket of addr */
+static inline struct futex_bucket* futex_bucket(void* addr)
+{
+	uintptr_t key = (uintptr_t) addr;
+	key ^= key >> 16;
+	key *= 0x9E3779B97F4A7C15ull;
+	return & futex_table[(key >> 32) % FUTEX_BUCKETS];
+}
+
+/* Lock and return the bucket of addr. Preemption must be off. */
+static struct futex_bucket* futex_lock_bucket(void* addr)
+{
+	struct futex_bucket* b = futex_bucket(addr);
+
+	Mutex_Lock(& b->lock);
+	if(b->waiters.next == NULL)
+		rlnode_init(& b->waiters, NULL);
+	return b;
+}
+
+/* Sleep on addr, releasing the (locked) bucket b. Preemption must be off. */
+static int futex_sleep(struct futex_bucket* b, void* addr, enum SCHED_CAUSE cause,
+	TimerDuration timeout)
+{
+	__futex_waiter waiter = { .thread=cur_thread(), .addr=addr, .woken=0, .removed=0 };
+	rlnode_init(& waiter.node, &waiter);
+	rlist_push_back(& b->waiters, & waiter.node);
+
+	/* Atomically release the bucket and sleep */
+	sleep_releasing(STOPPED, & b->lock, cause, timeout);
+
+	/* Woke up, tidy up if we were not removed by a waker */
+	Mutex_Lock(& b->lock);
+	if(! waiter.removed)
+		rlist_remove(& waiter.node);
+	Mutex_Unlock(& b->lock);
+
+	return waiter.woken;
+}
+
+static int futex_wait(int* addr, int val, enum SCHED_CAUSE cause)
+{
+	int preempt = preempt_off;
+	struct futex_bucket* b = futex_lock_bucket(addr);
+	int woken = 0;
+
+	/* Do not sleep if the value changed since the caller looked at it */
+	if(__atomic_load_n(addr, __ATOMIC_ACQUIRE) == val)
+		woken = futex_sleep(b, addr, cause, NO_TIMEOUT);
+	else
+		Mutex_Unlock(& b->lock);
+
+	if(preempt) preempt_on;
+	return woken;
+}
+
+/* Wake up to count waiters on addr, in the (locked) bucket b */
+static int futex_wake_locked(struct futex_bucket* b, void* addr, int count)
+{
+	int woken = 0;
+	rlnode* n = b->waiters.next;
+	while(woken < count && n != & b->waiters) {
+		__futex_waiter* w = n->obj;
+		n = n->next;
+		if(w->addr != addr) continue;
+
+		rlist_remove(& w->node);
+		w->removed = 1;
+		if(wakeup(w->thread)) {
+			w->woken = 1;
+			woken++;
+		}
+	}
+	return woken;
+}
+
+static int futex_wake(void* addr, int count)
+{
+	int preempt = preempt_off;
+	struct futex_bucket* b = futex_lock_bucket(addr);
+	int woken = futex_wake_locked(b, addr, count);
+	Mutex_Unlock(& b->lock);
+
+	if(preempt) preempt_on;
+	return woken;
+}
+
+int sys_FutexWait(int* addr, int val)
+{
+	return futex_wait(addr, val, SCHED_USER);
+}
+
+int sys_FutexWake(int* addr, int count)
+{
+	return futex_wake(addr, count);
+}
+
+
+/*
+ 	Pre-emption aware mutex.
+ 	-------------------------
+
+ 	This mutex will act as a spinlock if preemption is off, and a
+ 	blocking mutex if preemption is on.
+
+ 	Therefore, we can call the same function from both the preemptive and
+ 	the non-preemptive domain of the kernel.
+
+ 	The mutex word is 0 when unlocked, and otherwise holds the handle of
+ 	the owner thread (see TCB::handle), with bit MUTEX_WAITERS set when some thread may be blocked on it.
+ 	A contended locker in the preemptive domain spins while the owner is
+ 	running (never with a single core, as the owner cannot run meanwhile), 
+ 	then sets MUTEX_WAITERS and parks on the futex wait queue of the mutex.
+
+ 	The spin is adaptive, as in the adaptive mutexes of glibc. Each futex
+ 	bucket keeps a moving average of the spins that lockers of its mutexes
+ 	needed, and a locker spins for at most about twice that. Thus, a mutex
+ 	that is held for long, so that spinning does not pay, soon stops being
+ 	spun on. The history is shared by the mutexes of a bucket, and updated
+ 	without a lock; it is only a hint.
+ 	Unlock wakes exactly one parked thread, and only if MUTEX_WAITERS was
+ 	set, so the uncontended path never enters the scheduler.
+
+ 	Before parking, a locker lends its priority to the owner (priority
+ 	inheritance), so that an owner of low priority is not starved by 
+ 	threads of medium priority, while a thread of high priority waits for 
+ 	it. The owner gives the priority back when it unlocks the mutex, but
+ 	keeps the priorities lent on the other mutexes it holds.
+
+ 	The implementation is based on GCC atomics, as the standard C11 primitives
+ 	are not supported by all recent compilers. Eventually, this will change.
+ */
+#define MUTEX_WAITERS ((Mutex)1)
+#define MUTEX_NOOWNER ((Mutex)2)	/* owner tag used before the scheduler runs */
+
+static inline int mutex_cas(Mutex* lock, Mutex from, Mutex to)
+{
+  return __atomic_compare_exchange_n(lock, &from, to, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static inline Mutex mutex_self()
+{
+  TCB* cur = cur_thread_fast();
+  return (cur != NULL) ? (Mutex) cur->handle : MUTEX_NOOWNER;
+}
+
+/* Sleep until *lock changes from val, lending our priority to its owner */
+static void mutex_wait(Mutex* lock, Mutex val)
+{
+  int preempt = preempt_off;
+  struct futex_bucket* b = futex_lock_bucket(lock);
+
+  if(__atomic_load_n(lock, __ATOMIC_ACQUIRE) == val) {
+    /* The owner may have exited holding the mutex; this finds it by handle */
+    Mutex owner = val & ~MUTEX_WAITERS;
+    if(owner != MUTEX_NOOWNER)
+      sched_inherit_priority(owner, cur_thread()->priority, lock);
+    futex_sleep(b, lock, SCHED_MUTEX, NO_TIMEOUT);
+  }
+  else
+    Mutex_Unlock(& b->lock);
+
+  if(preempt) preempt_on;
+}
+
+/* Park until we find the mutex unlocked. Since others may still be
+   parked, we take it with MUTEX_WAITERS set. */
+static void mutex_lock_parked(Mutex* lock, Mutex self, lock_wait* lw)
+{
+  while(1) {
+    Mutex c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    if(c == 0) {
+      if(mutex_cas(lock, 0, self | MUTEX_WAITERS)) return;
+    }
+    else if((c & MUTEX_WAITERS) || mutex_cas(lock, c, c | MUTEX_WAITERS)) {
+      LOCKPROF_COUNT(lw, sleeps);
+      mutex_wait(lock, c | MUTEX_WAITERS);
+    }
+  }
+}
+
+/* 
+  Wait morphing: park w on the wait queue of lock, as if its thread had 
+  blocked in Mutex_Lock. This fails if lock is free, and then the thread 
+  should be woken up instead.
+ */
+static int mutex_requeue(Mutex* lock, __futex_waiter* w)
+{
+  int preempt = preempt_off;
+  struct futex_bucket* b = futex_lock_bucket(lock);
+  int parked = 0;
+
+  Mutex c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+  while(c != 0) {
+    if((c & MUTEX_WAITERS) || mutex_cas(lock, c, c | MUTEX_WAITERS)) {
+      rlist_push_back(& b->waiters, & w->node);
+      parked = 1;
+      break;
+    }
+    c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+  }
+
+  Mutex_Unlock(& b->lock);
+  if(preempt) preempt_on;
+  return parked;
+}
+
+/* Remove w from the wait queue of lock, unless a waker did */
+static void mutex_unqueue(Mutex* lock, __futex_waiter* w)
+{
+  int preempt = preempt_off;
+  struct futex_bucket* b = futex_lock_bucket(lock);
+  if(! w->removed)
+    rlist_remove(& w->node);
+  Mutex_Unlock(& b->lock);
+  if(preempt) preempt_on;
+}
+
+#define MUTEX_SPIN_MAX 200
+
+static void mutex_lock(Mutex* lock, lock_wait* lw)
+{
+  Mutex self = mutex_self();
+
+  /* Fast path */
+  if(mutex_cas(lock, 0, self)) return;
+
+  /* Non-preemptive domain: we cannot sleep, just spin */
+  if(! cpu_interrupts_enabled()) {
+    while(1) {
+      while(__atomic_load_n(lock, __ATOMIC_RELAXED) != 0) {
+        LOCKPROF_COUNT(lw, spins);
+        cpu_relax();
+      }
+      if(mutex_cas(lock, 0, self)) return;
+    }
+  }
+
+  /* Spin while the owner runs, it may be about to unlock */
+  struct futex_bucket* b = futex_bucket(lock);
+  int history = __atomic_load_n(& b->spins, __ATOMIC_RELAXED);
+  int budget = 2*history + 10;
+  if(budget > MUTEX_SPIN_MAX) budget = MUTEX_SPIN_MAX;
+
+  int spin;
+  int locked = 0;
+  for(spin=0; spin<budget; spin++) {
+    Mutex c = __atomic_load_n(lock, __ATOMIC_RELAXED);
+    if(c == 0) {
+      if(mutex_cas(lock, 0, self)) { locked = 1; break; }
+      continue;
+    }
+    if(c & MUTEX_WAITERS) break;   /* others are already parked, join them */
+    if(! sched_handle_running(c)) break;
+    LOCKPROF_COUNT(lw, spins);
+    cpu_relax();
+  }
+  __atomic_store_n(& b->spins, history + (spin - history)/8, __ATOMIC_RELAXED);
+
+  if(! locked)
+    mutex_lock_parked(lock, self, lw);
+}
+
+#ifdef LOCK_PROFILING
+
+void Mutex_Lock_at(Mutex* lock, const char* file, int line)
+{
+  lock_wait lw = { 0, 0 };
+  TimerDuration t0 = lockprof_clock();
+  mutex_lock(lock, &lw);
+  lockprof_acquired("mutex", file, line, lock, &lw, lockprof_clock() - t0);
+}
+
+/* The name is in parentheses, to escape the macro */
+void (Mutex_Lock)(Mutex* lock)
+{
+  Mutex_Lock_at(lock, NULL, 0);
+}
+
+#else
+
+void Mutex_Lock(Mutex* lock)
+{
+  mutex_lock(lock, NULL);
+}
+
+#endif
+
+
+int Mutex_TryLock(Mutex* lock)
+{
+  return mutex_cas(lock, 0, mutex_self());
+}
+
+
+void Mutex_Unlock(Mutex* lock)
+{
+#ifdef LOCK_PROFILING
+  lockprof_released(lock);
+#endif
+  if(__atomic_exchange_n(lock, 0, __ATOMIC_RELEASE) & MUTEX_WAITERS) {
+    futex_wake(lock, 1);
+    /* 
+      A waiter lends us its priority before it releases the bucket lock, 
+      which futex_wake took after our exchange, so we see every priority 
+      lent on this lock. Without one, we skip the scheduler lock.
+     */
+    TCB* cur = cur_thread_fast();
+    if(cur != NULL && cur->pi_saved >= 0)
+      sched_restore_priority(cur, lock);
+  }
+}
+
+
+/*
+ 	MCS queued spinlock.
+ 	--------------------
+
+ 	The lock is a pointer to the last node of a queue of waiters. A core
+ 	appends its node with an atomic exchange, and then spins on a flag 
+ 	in its own node, until its predecessor hands the lock over. Thus,
+ 	waiters are served in FIFO order, and they do not bounce the cache
+ 	line of the lock while spinning.
+ */
+static inline void mcs_lock(McsLock* lock, McsNode* node, lock_wait* lw)
+{
+  node->next = NULL;
+  node->locked = 1;
+
+  McsNode* pred = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+  if(pred != NULL) {
+    /* Queue up behind pred and wait for the handoff */
+    __atomic_store_n(&pred->next, node, __ATOMIC_RELEASE);
+    while(__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+      LOCKPROF_COUNT(lw, spins);
+      cpu_relax();
+    }
+  }
+}
+
+#ifdef LOCK_PROFILING
+
+void McsLock_Lock_at(McsLock* lock, McsNode* node, const char* file, int line)
+{
+  lock_wait lw = { 0, 0 };
+  TimerDuration t0 = lockprof_clock();
+  mcs_lock(lock, node, &lw);
+  lockprof_acquired("sched", file, line, lock, &lw, lockprof_clock() - t0);
+}
+
+void (McsLock_Lock)(McsLock* lock, McsNode* node)
+{
+  McsLock_Lock_at(lock, node, NULL, 0);
+}
+
+#else
+
+void McsLock_Lock(McsLock* lock, McsNode* node)
+{
+  mcs_lock(lock, node, NULL);
+}
+
+#endif
+
+
+int McsLock_TryLock(McsLock* lock, McsNode* node)
+{
+  McsNode* expected = NULL;
+  node->next = NULL;
+  node->locked = 0;
+  return __atomic_compare_exchange_n(&lock->tail, &expected, node, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+
+void McsLock_Unlock(McsLock* lock, McsNode* node)
+{
+#ifdef LOCK_PROFILING
+  lockprof_released(lock);
+#endif
+  McsNode* succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+  if(succ == NULL) {
+    /* No known successor: try to mark the lock free */
+    McsNode* expected = node;
+    if(__atomic_compare_exchange_n(&lock->tail, &expected, NULL, 0,
+                                   __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+      return;
+
+    /* A successor is between its exchange and linking to us */
+    while((succ = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL)
+      cpu_relax();
+  }
+  __atomic_store_n(&succ->locked, 0, __ATOMIC_RELEASE);
+}
+
+
+#ifdef LOCK_PROFILING
+
+/*
+	Lock profiling.
+	---------------
+
+	Call sites are kept in an open-addressing table keyed by (file,line),
+	which is only appended to, so lookups need no lock. The start of each
+	hold is kept in a second table keyed by the lock address; two locks 
+	held at once that share a slot lose some hold time, which is fine for
+	a profile. All counters are updated with relaxed atomics.
+ */
+
+#define LOCKPROF_SITES 512
+#define LOCKPROF_HOLDS 1024
+
+typedef struct lock_site {
+	const char* file;			/* NULL for a free slot */
+	int line;
+	const char* kind;
+	unsigned long acquires, contended, spins, sleeps;
+	TimerDuration wait_time, hold_time;	/* in nanoseconds */
+} lock_site;
+
+static lock_site lock_sites[LOCKPROF_SITES];
+static char lock_sites_busy;	/* serializes the insertion of sites */
+
+static struct lock_hold {
+	void* lock;
+	lock_site* site;
+	TimerDuration since;
+} lock_holds[LOCKPROF_HOLDS];
+
+/* The coarse bios_clock() is too coarse for this, we need nanoseconds */
+static TimerDuration lockprof_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static inline uintptr_t lockprof_hash(uintptr_t key)
+{
+	key ^= key >> 16;
+	key *= 0x9E3779B97F4A7C15ull;
+	return key >> 32;
+}
+
+static lock_site* lockprof_site(const char* kind, const char* file, int line)
+{
+	if(file == NULL) { file = "(user code)"; line = 0; }
+
+	uintptr_t h = lockprof_hash((uintptr_t)file + line);
+	int inserting = 0;
+	lock_site* site;
+
+	for(unsigned i = 0; ; i++) {
+		site = & lock_sites[(h + i) % LOCKPROF_SITES];
+		const char* f = __atomic_load_n(& site->file, __ATOMIC_ACQUIRE);
+		if(f == file && site->line == line) break;
+		if(f != NULL) continue;
+
+		/* An empty slot: the site is new. Look again under the lock. */
+		if(! inserting) {
+			while(__atomic_test_and_set(& lock_sites_busy, __ATOMIC_ACQUIRE))
+				cpu_relax();
+			inserting = 1;
+			i = -1;
+			continue;
+		}
+		site->line = line;
+		site->kind = kind;
+		__atomic_store_n(& site->file, file, __ATOMIC_RELEASE);
+		break;
+	}
+
+	if(inserting)
+		__atomic_clear(& lock_sites_busy, __ATOMIC_RELEASE);
+	return site;
+}
+
+static void lockprof_acquired(const char* kind, const char* file, int line, 
+	void* lock, lock_wait* lw, TimerDuration wait)
+{
+	lock_site* site = lockprof_site(kind, file, line);
+
+	__atomic_add_fetch(& site->acquires, 1, __ATOMIC_RELAXED);
+	if(lw->spins || lw->sleeps) {
+		__atomic_add_fetch(& site->contended, 1, __ATOMIC_RELAXED);
+		__atomic_add_fetch(& site->spins, lw->spins, __ATOMIC_RELAXED);
+		__atomic_add_fetch(& site->sleeps, lw->sleeps, __ATOMIC_RELAXED);
+		__atomic_add_fetch(& site->wait_time, wait, __ATOMIC_RELAXED);
+	}
+
+	struct lock_hold* hold = & lock_holds[lockprof_hash((uintptr_t)lock) % LOCKPROF_HOLDS];
+	hold->site = site;
+	hold->since = lockprof_clock();
+	hold->lock = lock;
+}
+
+static void lockprof_released(void* lock)
+{
+	struct lock_hold* hold = & lock_holds[lockprof_hash((uintptr_t)lock) % LOCKPROF_HOLDS];
+	if(hold->lock != lock) return;
+	hold->lock = NULL;
+	__atomic_add_fetch(& hold->site->hold_time, lockprof_clock() - hold->since, __ATOMIC_RELAXED);
+}
+
+void lock_profile_dump()
+{
+	/* Print the sites by decreasing wait time, then acquisitions */
+	static char printed[LOCKPROF_SITES];
+
+	fprintf(stderr, "%-6s %-28s %10s %10s %12s %8s %12s %12s\n",
+		"kind", "site", "acquires", "contended", "spins", "sleeps", "wait(us)", "hold(us)");
+
+	while(1) {
+		lock_site* best = NULL;
+		for(int i = 0; i < LOCKPROF_SITES; i++) {
+			lock_site* s = & lock_sites[i];
+			if(s->file == NULL || printed[i]) continue;
+			if(best == NULL || s->wait_time > best->wait_time 
+				|| (s->wait_time == best->wait_time && s->acquires > best->acquires))
+				best = s;
+		}
+		if(best == NULL) break;
+		printed[best - lock_sites] = 1;
+
+		char site[64];
+		snprintf(site, sizeof(site), "%s:%d", best->file, best->line);
+		fprintf(stderr, "%-6s %-28s %10lu %10lu %12lu %8lu %12lu %12lu\n",
+			best->kind, site, best->acquires, best->contended, best->spins, best->sleeps,
+			(unsigned long) best->wait_time/1000, (unsigned long) best->hold_time/1000);
+	}
+}
+
+#endif
+
+
+/*
+	Condition variables.	
+*/
+
+
+/** \cond HELPER Helper structure for condition variables. */
+typedef struct __cv_waiter {
+	rlnode node;				/* become part of a ring */
+	TCB* thread;				/* thread to wait */
+	sig_atomic_t signalled;		/* this is set if the thread is signalled */
+	sig_atomic_t removed;		/* this is set if the waiter is removed 
+								   from the ring */
+	Mutex* mutex;				/* the mutex to relock */
+	sig_atomic_t morphed;		/* this is set if the waiter was moved to
+								   the wait queue of the mutex */
+	__futex_waiter fw;			/* used to wait on the mutex when morphed */
+} __cv_waiter;
+/** \endcond */
+
+/**
+   @internal
+   A helper routine to remove a condition waiter from the CondVar ring.
+ */
+static inline void remove_from_ring(CondVar* cv, __cv_waiter* w)
+{
+	if(cv->waitset == w) {
+		/* Make cv->waitset safe */
+		__cv_waiter * nextw = w->node.next->obj;
+		cv->waitset =  (nextw == w) ? NULL : nextw;
+	}
+	rlist_remove(& w->node);
+}
+
+
+/** 
+   @internal
+   @brief Wait on a condition variable, specifying the cause. 
+
+	This function is the basic implementation for the 'wait' operation on
+	condition variables. It is used to implement the @c Cond_Wait and @c Cond_TimedWait
+	system calls, as well as internal kernel 'wait' functionality.
+
+  The function must be called only while we have locked the mutex that 
+  is associated with this call. It will put the calling thread to sleep, 
+  unlocking the mutex. These operations happen atomically.  
+
+  When the thread is woken up later (by another thread that calls @c 
+  Cond_Signal or @c Cond_Broadcast, or because the timeout has expired, or
+  because the thread was awoken by another kernel routine), 
+  it first re-locks the mutex and then returns.  
+
+  A signaller that finds the mutex locked does not wake the thread, but 
+  moves it to the wait queue of the mutex (wait morphing). The thread is 
+  woken by the unlock instead, and does not wake up just to block again 
+  on the mutex.
+
+  @param mx The mutex to be unlocked as the thread sleeps.
+  @param cv The condition variable to sleep on.
+  @param cause A cause provided to the kernel scheduler.
+  @param timeout The time to sleep, or @c NO_TIMEOUT to sleep for ever.
+
+  @returns 1 if this thread was woken up by signal/broadcast, 0 otherwise
+
+  @see Cond_Signal
+  @see Cond_Broadcast
+  */
+static int cv_wait(Mutex* mutex, CondVar* cv, 
+		enum SCHED_CAUSE cause, TimerDuration timeout)
+{
+	TCB* cur = cur_thread();
+	__cv_waiter waiter = { .thread=cur, .signalled = 0, .removed=0, 
+		.mutex=mutex, .morphed=0, 
+		.fw = { .thread=cur, .addr=mutex, .woken=0, .removed=0 } };
+	rlnode_init(& waiter.node, &waiter);
+	rlnode_init(& waiter.fw.node, &waiter.fw);
+
+	Mutex_Lock(&(cv->waitset_lock));
+	/* We just push the current thread to the back of the list */
+	if(cv->waitset) {
+		__cv_waiter* wset = cv->waitset;
+		rlist_push_back(& wset->node, & waiter.node);
+	} else {
+		cv->waitset = &waiter;
+	}
+
+	/* Now atomically release mutex and sleep */
+	Mutex_Unlock(mutex);
+	sleep_releasing(STOPPED, &(cv->waitset_lock), cause, timeout);
+
+	/* Woke up, we must check wether we were signaled, and tidy up */
+	Mutex_Lock(&(cv->waitset_lock));
+	if(! waiter.removed) {
+		assert(! waiter.signalled);
+
+		/* We must remove ourselves from the ring! */
+		remove_from_ring(cv, &waiter);
+	}
+	Mutex_Unlock(&(cv->waitset_lock));
+
+	if(waiter.morphed) {
+		/* We were woken by the unlock of mutex (or by the timeout) */
+		mutex_unqueue(mutex, &waiter.fw);
+		mutex_lock_parked(mutex, mutex_self(), NULL);
+	}
+	else
+		Mutex_Lock(mutex);
+	return waiter.signalled;
+}
+
+
+/**
+  @internal
+  Helper for Cond_Signal and Cond_Broadcast. This method 
+  will actually find a waiter to signal, if one exists. 
+  Else, it leaves the cv->waitset == NULL.
+ */
+static inline void cv_signal(CondVar* cv)
+{
+	/* Wakeup first process in the waiters' queue, if it exists. */
+	while(cv->waitset) {
+		__cv_waiter* waiter = cv->waitset;
+		remove_from_ring(cv, waiter);
+		waiter->removed = 1;
+		if(mutex_requeue(waiter->mutex, &waiter->fw)) {
+			waiter->morphed = 1;
+			waiter->signalled = 1;
+			return;
+		}
+		if(wakeup(waiter->thread)) {
+			waiter->signalled = 1;
+			return;
+		}
+	}
+}
+
+
+
+int Cond_Wait(Mutex* mutex, CondVar* cv)
+{
+	return cv_wait(mutex, cv, SCHED_USER, NO_TIMEOUT);
+}
+
+int Cond_TimedWait(Mutex* mutex, CondVar* cv, timeout_t timeout)
+{
+	/* We have to translate timeout from msec to usec */
+	return cv_wait(mutex, cv, SCHED_USER, timeout*1000ul);
+}
+
+
+void Cond_Signal(CondVar* cv)
+{
+  Mutex_Lock(&(cv->waitset_lock));
+  cv_signal(cv);
+  Mutex_Unlock(&(cv->waitset_lock));
+}
+
+
+void Cond_Broadcast(CondVar* cv)
+{
+  Mutex_Lock(&(cv->waitset_lock));
+  while(cv->waitset) cv_signal(cv);
+  Mutex_Unlock(&(cv->waitset_lock));
+}
+
+
+
+/*
+	Reader-writer locks.
+	--------------------
+
+	The state word of a RWLock holds the number of readers and the flags 
+	below. Readers and writers get in with a CAS when there is no conflict.
+	Otherwise they sleep on two futex queues, keyed by &rw->state (readers)
+	and &rw->writers (writers). Both queues live in the bucket of rw, so 
+	that a single bucket lock orders all the slow paths. rw->writers counts 
+	the sleeping writers and is only touched under the bucket lock.
+
+	Writers are preferred: while a writer waits (RW_WWAIT), new readers 
+	block, and an unlocking writer hands over to the next writer, before
+	it releases the readers.
+ */
+#define RW_WRITER   0x40000000	/* held by a writer */
+#define RW_WWAIT    0x20000000	/* writers are waiting */
+#define RW_RWAIT    0x10000000	/* readers may be waiting */
+#define RW_READERS  0x0fffffff	/* the number of readers */
+
+static inline int sync_cas(int* word, int from, int to)
+{
+  return __atomic_compare_exchange_n(word, &from, to, 0, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+/* Translate a timeout to a deadline */
+static TimerDuration sync_deadline(TimerDuration timeout)
+{
+  return (timeout == NO_TIMEOUT) ? NO_TIMEOUT : bios_clock() + timeout;
+}
+
+/* The time left until deadline, or 0 if it has passed */
+static TimerDuration sync_time_left(TimerDuration deadline)
+{
+  if(deadline == NO_TIMEOUT) return NO_TIMEOUT;
+  TimerDuration now = bios_clock();
+  return (deadline > now) ? deadline - now : 0;
+}
+
+/* Wake up all sleeping readers. The bucket of rw must be locked. */
+static void rw_wake_readers(struct futex_bucket* b, RWLock* rw)
+{
+  __atomic_and_fetch(& rw->state, ~RW_RWAIT, __ATOMIC_SEQ_CST);
+  futex_wake_locked(b, & rw->state, INT_MAX);
+}
+
+static int rw_read_lock(RWLock* rw, TimerDuration timeout)
+{
+  TimerDuration deadline = sync_deadline(timeout);
+  int preempt = preempt_off;
+  struct futex_bucket* b = futex_lock_bucket(rw);
+  int locked = 0;
+
+  while(1) {
+    int s = __atomic_load_n(& rw->state, __ATOMIC_SEQ_CST);
+    if(! (s & (RW_WRITER|RW_WWAIT))) {
+      if(sync_cas(& rw->state, s, s+1)) { locked = 1; break; }
+      continue;
+    }
+    if(! (s & RW_RWAIT) && ! sync_cas(& rw->state, s, s|RW_RWAIT)) continue;
+
+    TimerDuration left = sync_time_left(deadline);
+    if(left == 0) break;
+    futex_sleep(b, & rw->state, SCHED_USER, left);
+    Mutex_Lock(& b->lock);
+  }
+
+  Mutex_Unlock(& b->lock);
+  if(preempt) preempt_on;
+  return locked;
+}
+
+static int rw_write_lock(RWLock* rw, TimerDuration timeout)
+{
+  TimerDuration deadline = sync_deadline(timeout);
+  int preempt = preempt_off;
+  struct futex_bucket* b = futex_lock_bucket(rw);
+  int locked = 0;
+
+  /* Announce ourselves, this stops new readers */
+  rw->writers++;
+  __atomic_or_fetch(& rw->state, RW_WWAIT, __ATOMIC_SEQ_CST);
+
+  /* Check for the lock before the timeout, since we may have been handed
+     the wakeup of an unlock */
+  while(1) {
+    int s = __atomic_load_n(& rw->state, __ATOMIC_SEQ_CST);
+    if((s & (RW_WRITER|RW_READERS)) == 0) {
+      if(sync_cas(& rw->state, s, s|RW_WRITER)) { locked = 1; break; }
+      continue;
+    }
+
+    TimerDuration left = sync_time_left(deadline);
+    if(left == 0) break;
+    futex_sleep(b, & rw->writers, SCHED_USER, left);
+    Mutex_Lock(& b->lock);
+  }
+
+  if(--rw->writers == 0) {
+    int s = __atomic_and_fetch(& rw->state, ~RW_WWAIT, __ATOMIC_SEQ_CST);
+    /* We gave up, and no writer is left to release the readers */
+    if(! locked && ! (s & RW_WRITER) && (s & RW_RWAIT))
+      rw_wake_readers(b, rw);
+  }
+
+  Mutex_Unlock(& b->lock);
+  if(preempt) preempt_on;
+  return locked;
+}
+
+void sys_RWLock_ReadLock(RWLock* rw)
+{
+  int s = __atomic_load_n(& rw->state, __ATOMIC_RELAXED);
+  if(! (s & (RW_WRITER|RW_WWAIT)) && sync_cas(& rw->state, s, s+1)) return;
+  rw_read_lock(rw, NO_TIMEOUT);
+}
+
+int sys_RWLock_TimedReadLock(RWLock* rw, timeout_t timeout)
+{
+  int s = __atomic_load_n(& rw->state, __ATOMIC_RELAXED);
+  if(! (s & (RW_WRITER|RW_WWAIT)) && sync_cas(& rw->state, s, s+1)) return 1;
+  /* We have to translate timeout from msec to usec */
+  return rw_read_lock(rw, timeout*1000ul);
+}
+
+void sys_RWLock_ReadUnlock(RWLock* rw)
+{
+  int s = __atomic_sub_fetch(& rw->state, 1, __ATOMIC_SEQ_CST);
+
+  /* The last reader out lets a writer in */
+  if((s & RW_READERS) == 0 && (s & RW_WWAIT)) {
+    int preempt = preempt_off;
+    struct futex_bucket* b = futex_lock_bucket(rw);
+    futex_wake_locked(b, & rw->writers, 1);
+    Mutex_Unlock(& b->lock);
+    if(preempt) preempt_on;
+  }
+}
+
+void sys_RWLock_WriteLock(RWLock* rw)
+{
+  if(sync_cas(& rw->state, 0, RW_WRITER)) return;
+  rw_write_lock(rw, NO_TIMEOUT);
+}
+
+int sys_RWLock_TimedWriteLock(RWLock* rw, timeout_t timeout)
+{
+  if(sync_cas(& rw->state, 0, RW_WRITER)) return 1;
+  return rw_write_lock(rw, timeout*1000ul);
+}
+
+void sys_RWLock_WriteUnlock(RWLock* rw)
+{
+  int s = __atomic_and_fetch(& rw->state, ~RW_WRITER, __ATOMIC_SEQ_CST);
+
+  if(s & (RW_WWAIT|RW_RWAIT)) {
+    int preempt = preempt_off;
+    struct futex_bucket* b = futex_lock_bucket(rw);
+    if(rw->writers > 0)
+      futex_wake_locked(b, & rw->writers, 1);
+    else if(__atomic_load_n(& rw->state, __ATOMIC_SEQ_CST) & RW_RWAIT)
+      rw_wake_readers(b, rw);
+    Mutex_Unlock(& b->lock);
+    if(preempt) preempt_on;
+  }
+}
+
+
+/*
+	Counting semaphores.
+	--------------------
+
+	The count is taken with a CAS. A thread that finds it 0 sleeps on the
+	futex queue of the semaphore, after it has announced itself in 
+	sem->waiters, so that Sem_Post only enters the kernel wait queues when
+	someone may be asleep.
+ */
+
+static int sem_wait(Semaphore* sem, TimerDuration timeout)
+{
+  TimerDuration deadline = sync_deadline(timeout);
+  int preempt = preempt_off;
+  struct futex_bucket* b = futex_lock_bucket(sem);
+  int taken = 0;
+
+  __atomic_add_fetch(& sem->waiters, 1, __ATOMIC_SEQ_CST);
+  while(1) {
+    int c = __atomic_load_n(& sem->count, __ATOMIC_SEQ_CST);
+    if(c > 0) {
+      if(sync_cas(& sem->count, c, c-1)) { taken = 1; break; }
+      continue;
+    }
+
+    TimerDuration left = sync_time_left(deadline);
+    if(left == 0) break;
+    futex_sleep(b, sem, SCHED_USER, left);
+    Mutex_Lock(& b->lock);
+  }
+  __atomic_sub_fetch(& sem->waiters, 1, __ATOMIC_SEQ_CST);
+
+  Mutex_Unlock(& b->lock);
+  if(preempt) preempt_on;
+  return taken;
+}
+
+static inline int sem_trywait(Semaphore* sem)
+{
+  int c = __atomic_load_n(& sem->count, __ATOMIC_RELAXED);
+  return c > 0 && sync_cas(& sem->count, c, c-1);
+}
+
+void sys_Sem_Wait(Semaphore* sem)
+{
+  if(! sem_trywait(sem))
+    sem_wait(sem, NO_TIMEOUT);
+}
+
+int sys_Sem_TimedWait(Semaphore* sem, timeout_t timeout)
+{
+  return sem_trywait(sem) || sem_wait(sem, timeout*1000ul);
+}
+
+void sys_Sem_Post(Semaphore* sem)
+{
+  __atomic_add_fetch(& sem->count, 1, __ATOMIC_SEQ_CST);
+
+  if(__atomic_load_n(& sem->waiters, __ATOMIC_SEQ_CST) > 0) {
+    int preempt = preempt_off;
+    struct futex_bucket* b = futex_lock_bucket(sem);
+    futex_wake_locked(b, sem, 1);
+    Mutex_Unlock(& b->lock);
+    if(preempt) preempt_on;
+  }
+}
+
+
+
+
+
+/*
+ *
+ * Kernel condition waiting
+ *
+ */
+
+/*
+  There used to be a big kernel lock here, a semaphore held by every system
+  call. It is gone: kernel objects carry their own mutexes, and the wait
+  operations below release the mutex of the object being waited on.
+ */
+
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan_name, TimerDuration timeout)
+{
+	return cv_wait(mx, cv, cause, timeout);
+}
+
+void kernel_signal(CondVar* cv) 
+{ 
+	Cond_Signal(cv); 
+}
+
+void kernel_broadcast(CondVar* cv) 
+{ 
+	Cond_Broadcast(cv); 
+}
+
+void kernel_sleep(Mutex* mx, Thread_state newstate, enum SCHED_CAUSE cause)
+{
+	sleep_releasing(newstate, mx, cause, NO_TIMEOUT);
+}
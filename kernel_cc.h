@@ -0,0 +1,179 @@
+/*
+ *  Concurrency Control API
+ *
+ */
+
+
+#ifndef __KERNEL_CC_H
+#define __KERNEL_CC_H
+
+
+/**
+	@file kernel_cc.h
+	@brief Concurrency and preemption control API.
+
+	@defgroup cc Concurrency control.
+	@ingroup kernel
+	@brief Concurrency and preemption control API.
+
+	This file provides routines for concurrency control and preemption management. 
+*/
+
+
+
+
+/* 
+	Many of the header definitions for Mutexes and CondVars are in the 
+   	tinyos.h file
+*/
+#include "kernel_sys.h"
+#include "kernel_sched.h"
+
+
+
+
+/**
+	@brief Try to lock a mutex without waiting.
+
+	This is used where spinning would risk a deadlock, e.g., when
+	a core holding its own scheduler lock tries to lock a peer's.
+
+	@returns 1 if the mutex was locked, 0 if it was already held.
+ */
+int Mutex_TryLock(Mutex* lock);
+
+
+/**
+	@brief Lock an MCS lock, spinning on the given queue node.
+
+	The node must not be in use by any other lock, and it must be passed
+	to the matching @c McsLock_Unlock. Unlike @c Mutex_Lock, this never 
+	yields, so it must be called with preemption off.
+ */
+void McsLock_Lock(McsLock* lock, McsNode* node);
+
+/**
+	@brief Try to lock an MCS lock without waiting.
+
+	@returns 1 if the lock was taken (with @c node at the queue), 0 if it 
+	was already held.
+ */
+int McsLock_TryLock(McsLock* lock, McsNode* node);
+
+/**
+	@brief Unlock an MCS lock, handing it to the next waiter, if any.
+ */
+void McsLock_Unlock(McsLock* lock, McsNode* node);
+
+
+/**
+	@brief Lock contention profiling.
+
+	When this is defined, every call site of @c Mutex_Lock and @c McsLock_Lock
+	in the kernel (the latter covers the scheduler locks) is charged with its
+	acquisitions, how many of them were contended, the spin iterations, 
+	the sleeps (yields with @c SCHED_MUTEX), and the time spent waiting for 
+	and holding the lock. Calls from user code are charged to a single site.
+	The table is printed to stderr at shutdown, by @c lock_profile_dump().
+
+	Uncomment, or add -DLOCK_PROFILING to CFLAGS, to enable.
+ */
+//#define LOCK_PROFILING
+
+#ifdef LOCK_PROFILING
+
+/** @brief Profiled @c Mutex_Lock, charged to @c file and @c line. */
+void Mutex_Lock_at(Mutex* lock, const char* file, int line);
+
+/** @brief Profiled @c McsLock_Lock, charged to @c file and @c line. */
+void McsLock_Lock_at(McsLock* lock, McsNode* node, const char* file, int line);
+
+#define Mutex_Lock(lock) Mutex_Lock_at((lock), __FILE__, __LINE__)
+#define McsLock_Lock(lock, node) McsLock_Lock_at((lock), (node), __FILE__, __LINE__)
+
+/** @brief Print the lock profile to stderr, busiest sites first. */
+void lock_profile_dump();
+
+#endif
+
+
+/*
+ * Kernel condition waiting.
+ *
+ * There is no global kernel lock. Each kernel object (process table, PCB,
+ * pipe, socket, device) is protected by its own mutex, and system calls
+ * block by waiting on a condition variable while releasing the mutex
+ * of the object they are waiting on.
+ */
+
+/**
+	@brief Wait on a condition variable, releasing a kernel object lock.
+
+	The calling thread must hold @c mx. It is released atomically as the
+	thread goes to sleep, and re-acquired before this call returns.
+
+	@returns 1 if signalled, 0 if not
+  */
+int kernel_wait_wchan(Mutex* mx, CondVar* cv, enum SCHED_CAUSE cause, 
+	const char* wchan, TimerDuration timeout);
+
+#define kernel_wait(mx, cv, cause) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, NO_TIMEOUT)
+#define kernel_timedwait(mx, cv, cause, timeout) \
+	kernel_wait_wchan((mx),(cv),(cause),__FUNCTION__, (timeout))
+
+/**
+	@brief Signal a kernel condition to one waiter.
+
+	This call must be made while holding the lock that the waiters
+	pass to @c kernel_wait, else the wakeup may be lost.
+  */
+void kernel_signal(CondVar* cv);
+
+/**
+	@brief Signal a kernel condition to all waiters.
+
+	The same locking rule as for @c kernel_signal applies.
+  */
+void kernel_broadcast(CondVar* cv);
+
+
+/**
+	@brief Put thread to sleep, releasing a kernel object lock.
+
+	This is used by an exiting thread, to release the lock that protects
+	its exit status only once it is off the ready queues.
+  */
+void kernel_sleep(Mutex* mx, Thread_state state, enum SCHED_CAUSE cause);
+
+
+
+/** @brief Set the preemption status for the current core.
+
+ 	Preemption is disabled by disabling interrupts. 
+
+	A typical non-preemptive section is declared as
+	@code
+	int preempt = preempt_off;
+	..
+	    // do stuff without preemption 
+	...
+	if(preempt) preempt_on;
+	@endcode
+
+ 	@returns the previous preemption status, where 0 means that preemption was previously off,
+ 	and 1 means that it was on.
+
+ 	@see preempt_on
+*/
+#define preempt_off  cpu_disable_interrupts()
+
+/** @brief Easily turn preemption off.
+	@see set_core_preemption
+ */
+#define preempt_on  cpu_enable_interrupts()
+
+
+#endif
+
+
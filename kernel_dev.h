@@ -105,6 +105,8 @@ typedef struct pipe_control_block {
 
   FCB *reader, *writer;
 
+  Mutex lock;         // Protects all fields below, and waiting on the condition variables
+
   CondVar has_space;  // For blocking writer if no space is available
   CondVar has_data;   // For blocking reader until data are available
 
@@ -232,6 +234,8 @@ typedef struct unbound_socket {
 
 typedef struct socket_control_block {
 
+  Mutex lock;   /* Protects the socket, and waiting on the conditions of its union */
+
   uint refcount;
 
   FCB* fcb;
@@ -251,7 +255,7 @@ typedef struct socket_control_block {
 
 typedef struct connection_request {
 
-  int admitted;
+  int admitted;   /* 0 while pending, 1 if admitted, -1 if refused by Accept */
   SCB* peer;
 
   CondVar connected_cv;
@@ -43,6 +43,7 @@ int sys_Pipe(pipe_t* pipe)
 	/*Initialize Pipe Control Block*/
 	p_PIPE_CB->reader = fcbs[0];
 	p_PIPE_CB->writer = fcbs[1];
+	p_PIPE_CB->lock = MUTEX_INIT;
 	p_PIPE_CB->has_space = COND_INIT;
 	p_PIPE_CB->has_data = COND_INIT;
 	p_PIPE_CB->w_pos = 0;
@@ -66,8 +67,14 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 	pipe_cb* p_pipe= (pipe_cb*)pipecb_t;
 
 
-	// check if pipe or the in/out streamfunctions are NULL
-	if (p_pipe == NULL || p_pipe->reader == NULL || p_pipe->writer == NULL) {
+	if (p_pipe == NULL)
+		return -1;
+
+	Mutex_Lock(&p_pipe->lock);
+
+	// check if the in/out streamfunctions are NULL
+	if (p_pipe->reader == NULL || p_pipe->writer == NULL) {
+		Mutex_Unlock(&p_pipe->lock);
 		return -1;
 	}
 
@@ -77,7 +84,7 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 	/*------- ENTER IN CRITICAL SECTION -------*/
 	while(available_bytes == 0 && p_pipe->reader != NULL) {
 		// while there is no room to write , we must signal the reader , and then wait for it to read some data.
-		kernel_wait(&p_pipe->has_space, SCHED_PIPE);
+		kernel_wait(&p_pipe->lock, &p_pipe->has_space, SCHED_PIPE);
 
 		// When writer resurrects, the w_pos and r_pos will have changed, so available bytes needs to be re-evaluated
 		available_bytes = p_pipe->available_buffer_space;
@@ -98,6 +105,8 @@ int pipe_write(void* pipecb_t, const char *buf, unsigned int n)
 	// Resurrect all readers
 	kernel_broadcast(&p_pipe->has_data);
 
+	Mutex_Unlock(&p_pipe->lock);
+
 	return k;
 }
 
@@ -109,27 +118,41 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n)
 	pipe_cb* p_pipe= (pipe_cb*)pipecb_t;
 
 
-	// check if pipe or the in/out streamfunctions are NULL
-	if (p_pipe == NULL || p_pipe->reader == NULL) {
+	if (p_pipe == NULL)
+		return -1;
+
+	Mutex_Lock(&p_pipe->lock);
+
+	// check if the in/out streamfunctions are NULL
+	if (p_pipe->reader == NULL) {
+		Mutex_Unlock(&p_pipe->lock);
 		return -1;
 	}
 
 	uint available_bytes = p_pipe->available_buffer_space;
 
 	// if there is no writer and pipe buffer is empty, bytes read = 0.
-	if (p_pipe->writer == NULL && available_bytes == PIPE_BUFFER_SIZE)
+	if (p_pipe->writer == NULL && available_bytes == PIPE_BUFFER_SIZE) {
+		Mutex_Unlock(&p_pipe->lock);
 		return 0;
+	}
 
 
 	/*------- ENTER IN CRITICAL SECTION -------*/
-	while( available_bytes == PIPE_BUFFER_SIZE ) {
+	while( available_bytes == PIPE_BUFFER_SIZE && p_pipe->writer != NULL ) {
 		// while there are no data written , we must wait until writer writes some data.
-		kernel_wait(&p_pipe->has_data, SCHED_PIPE);
+		kernel_wait(&p_pipe->lock, &p_pipe->has_data, SCHED_PIPE);
 
 		// When reader resurrects, the w_pos and r_pos will have changed, so available bytes needs to be re-evaluated
 		available_bytes = p_pipe->available_buffer_space;
 	}
 
+	// the writer closed while we were waiting on an empty buffer
+	if (available_bytes == PIPE_BUFFER_SIZE) {
+		Mutex_Unlock(&p_pipe->lock);
+		return 0;
+	}
+
 	uint bytes_to_read = PIPE_BUFFER_SIZE - available_bytes;
 
 	// if size of buffer n is less than bytes to be read, read only n chars.
@@ -145,6 +168,8 @@ int pipe_read(void* pipecb_t, char *buf, unsigned int n)
 	// resurrect all readers
 	kernel_broadcast(&p_pipe->has_space);
 
+	Mutex_Unlock(&p_pipe->lock);
+
 	return k;
 }
 
@@ -159,10 +184,15 @@ int pipe_writer_close(void* _pipecb)
 	if (p_pipe == NULL)
 		return -1;
 
+	Mutex_Lock(&p_pipe->lock);
 	p_pipe->writer = NULL;
+	int last = (p_pipe->reader == NULL);
+	// a blocked reader must see the end of the stream
+	kernel_broadcast(&p_pipe->has_data);
+	Mutex_Unlock(&p_pipe->lock);
 
 	// if there is no reader fcb we free all the pipe I/O and the pipe itself.
-	if (p_pipe->reader == NULL) {
+	if (last) {
 		free(p_pipe->writer);
 		free(p_pipe->reader);
 		free(p_pipe);
@@ -184,12 +214,17 @@ int pipe_reader_close(void* _pipecb)
 	if (p_pipe == NULL)
 		return -1;
 
+	Mutex_Lock(&p_pipe->lock);
 	p_pipe->reader = NULL;
+	// a blocked writer must see that nobody reads any more
+	kernel_broadcast(&p_pipe->has_space);
 
 	uint bytes_to_read = PIPE_BUFFER_SIZE - p_pipe->available_buffer_space;
+	int last = (bytes_to_read == 0 && p_pipe->writer == NULL);
+	Mutex_Unlock(&p_pipe->lock);
 
 	// if there are no available data to read and there is no writer , free all
-	if (bytes_to_read == 0 && p_pipe->writer == NULL) {
+	if (last) {
 		free(p_pipe->reader);
 		free(p_pipe->writer);
 		free(p_pipe);
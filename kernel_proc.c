@@ -17,6 +17,9 @@
 PCB PT[MAX_PROC];
 unsigned int process_count;
 
+/* Protects PT allocation and the process tree */
+Mutex proc_table_lock = MUTEX_INIT;
+
 PCB* get_pcb(Pid_t pid)
 {
   return PT[pid].pstate==FREE ? NULL : &PT[pid];
@@ -40,6 +43,7 @@ static inline void initialize_PCB(PCB* pcb)
 
   pcb->thread_count = 0;
   rlnode_init(&pcb->ptcb_list,NULL);
+  pcb->lock = MUTEX_INIT;
 
 
   rlnode_init(& pcb->children_list, NULL);
@@ -78,7 +82,7 @@ void initialize_processes()
 
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held
 */
 PCB* acquire_PCB()
 {
@@ -87,6 +91,8 @@ PCB* acquire_PCB()
   if(pcb_freelist != NULL) {
     pcb = pcb_freelist;
     pcb->pstate = ALIVE;
+    pcb->stats = (sched_stats) { 0 };
+    pcb->gang = 0;
     pcb_freelist = pcb_freelist->parent;
     process_count++;
   }
@@ -95,7 +101,7 @@ PCB* acquire_PCB()
 }
 
 /*
-  Must be called with kernel_mutex held
+  Must be called with proc_table_lock held
 */
 void release_PCB(PCB* pcb)
 {
@@ -136,6 +142,8 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 {
   PCB *curproc, *newproc;
   
+  Mutex_Lock(&proc_table_lock);
+
   /* The new process PCB */
   newproc = acquire_PCB();
 
@@ -156,11 +164,13 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     rlist_push_front(& curproc->children_list, & newproc->children_node);
 
     /* Inherit file streams from parent */
+    Mutex_Lock(&curproc->lock);
     for(int i=0; i<MAX_FILEID; i++) {
        newproc->FIDT[i] = curproc->FIDT[i];
        if(newproc->FIDT[i])
           FCB_incref(newproc->FIDT[i]);
     }
+    Mutex_Unlock(&curproc->lock);
   }
 
 
@@ -182,7 +192,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
     the initialization of the PCB.
    */
   if(call != NULL) {
-    newproc->main_thread = spawn_thread(newproc, start_main_thread);
+    newproc->main_thread = spawn_thread(newproc, start_main_thread, 0);
     newproc->thread_count++;
     acquire_ptcb(newproc->main_thread, call, argl, args);
     wakeup(newproc->main_thread);
@@ -190,6 +200,7 @@ Pid_t sys_Exec(Task call, int argl, void* args)
 
 
 finish:
+  Mutex_Unlock(&proc_table_lock);
   return get_pid(newproc);
 }
 
@@ -203,10 +214,14 @@ Pid_t sys_GetPid()
 
 Pid_t sys_GetPPid()
 {
-  return get_pid(CURPROC->parent);
+  Mutex_Lock(&proc_table_lock);
+  Pid_t ppid = get_pid(CURPROC->parent);
+  Mutex_Unlock(&proc_table_lock);
+  return ppid;
 }
 
 
+/* Must be called with proc_table_lock held */
 static void cleanup_zombie(PCB* pcb, int* status)
 {
   if(status != NULL)
@@ -238,7 +253,7 @@ static Pid_t wait_for_specific_child(Pid_t cpid, int* status)
 
   /* Ok, child is a legal child of mine. Wait for it to exit. */
   while(child->pstate == ALIVE)
-    kernel_wait(& parent->child_exit, SCHED_USER);
+    kernel_wait(&proc_table_lock, & parent->child_exit, SCHED_USER);
   
   cleanup_zombie(child, status);
   
@@ -262,7 +277,7 @@ static Pid_t wait_for_any_child(int* status)
     has_exited = ! is_rlist_empty(& parent->exited_list);
     if( has_exited ) break;
 
-    kernel_wait(& parent->child_exit, SCHED_USER);    
+    kernel_wait(&proc_table_lock, & parent->child_exit, SCHED_USER);    
   }
 
   if(no_children)
@@ -279,15 +294,19 @@ static Pid_t wait_for_any_child(int* status)
 
 Pid_t sys_WaitChild(Pid_t cpid, int* status)
 {
+  Mutex_Lock(&proc_table_lock);
+
   /* Wait for specific child. */
   if(cpid != NOPROC) {
-    return wait_for_specific_child(cpid, status);
+    cpid = wait_for_specific_child(cpid, status);
   }
   /* Wait for any child */
   else {
-    return wait_for_any_child(status);
+    cpid = wait_for_any_child(status);
   }
 
+  Mutex_Unlock(&proc_table_lock);
+  return cpid;
 }
 
 
@@ -297,7 +316,9 @@ void sys_Exit(int exitval)
   PCB *curproc = CURPROC;  /* cache for efficiency */
 
   /* First, store the exit status */
+  Mutex_Lock(&proc_table_lock);
   curproc->exitval = exitval;
+  Mutex_Unlock(&proc_table_lock);
 
   /* 
     Here, we must check that we are not the init task. 
@@ -346,6 +367,8 @@ Fid_t sys_OpenInfo()
 
 
 
+_Static_assert(PROCINFO_CAUSES == SCHED_CAUSES, "procinfo.blocked_time is indexed by SCHED_CAUSE");
+
 int procinfo_read(void* pr,char* buf, unsigned int size){
 
   PROCINF_CB* procinfocb =(PROCINF_CB*)pr;
@@ -353,6 +376,8 @@ int procinfo_read(void* pr,char* buf, unsigned int size){
   if(procinfocb==NULL || procinfocb->cursor== NULL)
     return -1;
   
+  Mutex_Lock(&proc_table_lock);
+
 
   // Initialize procinfo inside proc info control block
   procinfocb -> procinfo = (procinfo*)xmalloc(sizeof(procinfo));
@@ -377,6 +402,22 @@ int procinfo_read(void* pr,char* buf, unsigned int size){
 
   // copy data
   memcpy(procinfocb->procinfo->args, procinfocb->cursor->args, args_size);
+
+  // CPU accounting: the exited threads, plus the live ones
+  Mutex_Lock(&procinfocb->cursor->lock);
+  sched_stats stats = procinfocb->cursor->stats;
+  rlnode* ptcb_list = &procinfocb->cursor->ptcb_list;
+  for(rlnode* n = ptcb_list->next; n != ptcb_list; n = n->next){
+    PTCB* ptcb = n->ptcb;
+    if(!ptcb->exited)
+      sched_stats_add(&stats, &ptcb->tcb->stats);
+  }
+  Mutex_Unlock(&procinfocb->cursor->lock);
+  procinfocb->procinfo->cpu_time = stats.run_time;
+  procinfocb->procinfo->vol_switches = stats.vol_switches;
+  procinfocb->procinfo->invol_switches = stats.invol_switches;
+  for(int c = 0; c < PROCINFO_CAUSES; c++)
+    procinfocb->procinfo->blocked_time[c] = stats.blocked_time[c];
   //memcpy(buf, (char*)&procinfocb->procinfo, sizeof(procinfo));
   memcpy(buf, procinfocb->procinfo,size);
 
@@ -386,6 +427,8 @@ int procinfo_read(void* pr,char* buf, unsigned int size){
   // increment cursor to the next PCB
   procinfocb->cursor = get_pcb( get_pid(procinfocb->cursor) + 1 );
 
+  Mutex_Unlock(&proc_table_lock);
+
   return size;
 }
 
@@ -404,8 +447,101 @@ int procinfo_close(void* pr){
 }
 
 
+// ****** sys_SetGang *******
+
+int sys_SetGang(int on)
+{
+  PCB* curproc = CURPROC;
+
+  Mutex_Lock(&curproc->lock);
+
+  curproc->gang = (on != 0);
+
+  // move the live threads to the queues of their new class
+  rlnode* ptcb_list = &curproc->ptcb_list;
+  for(rlnode* n = ptcb_list->next; n != ptcb_list; n = n->next){
+    PTCB* ptcb = n->ptcb;
+    if(!ptcb->exited)
+      sched_set_gang(ptcb->tcb, curproc->gang);
+  }
+
+  // none of our threads is left to run in our slot
+  if(!curproc->gang)
+    sched_gang_release(curproc);
+
+  Mutex_Unlock(&curproc->lock);
+
+  return 0;
+}
+
+
+// ****** sys_schedinfo *******
+
+file_ops schedinfo_ops = {
+  .Open  = NULL,
+  .Read  = schedinfo_read,
+  .Write = NULL,
+  .Close = schedinfo_close
+};
+
+
+Fid_t sys_OpenSchedInfo()
+{
+  Fid_t fid;
+  FCB* fcb;
+  if(!FCB_reserve(1,&fid,&fcb))
+    return NOFILE;
+
+  SCHEDINF_CB* sched_info = (SCHEDINF_CB*)xmalloc(sizeof(SCHEDINF_CB));
+  fcb -> streamobj  = sched_info;
+  fcb -> streamfunc = &schedinfo_ops;
+
+  sched_info -> cursor = 0;
+
+  return fid;
+}
+
+
+int schedinfo_read(void* sr, char* buf, unsigned int size){
+
+  SCHEDINF_CB* schedinfocb = (SCHEDINF_CB*)sr;
+
+  if(schedinfocb == NULL)
+    return -1;
+
+  // past the last core
+  if(schedinfocb->cursor >= cpu_cores())
+    return 0;
+
+  schedinfo info;
+  sched_latency_read(schedinfocb->cursor, &info);
+
+  if(size > sizeof(schedinfo))
+    size = sizeof(schedinfo);
+  memcpy(buf, &info, size);
+
+  schedinfocb->cursor++;
+
+  return size;
+}
+
+
+int schedinfo_close(void* sr){
+  SCHEDINF_CB* schedinfo_cb = (SCHEDINF_CB*) sr;
+
+  if(schedinfo_cb == NULL)
+    return -1;
+
+  free(schedinfo_cb);
+
+  return 0;
+}
+
+
 /*
  * Creating create_ptcb
+ * Must be called with the lock of the owner PCB held, unless the
+ * process is still being created.
  */
 
 void acquire_ptcb(TCB* tcb, Task task, int argl, void* args) {
@@ -415,6 +551,10 @@ void acquire_ptcb(TCB* tcb, Task task, int argl, void* args) {
   ptcb->tcb = tcb;  
   tcb->ptcb = ptcb;
 
+  // the new thread joins the gang of its process, if any
+  if(tcb->owner_pcb->gang)
+    sched_set_gang(tcb, 1);
+
   ptcb->task = task;
   ptcb->argl = argl;
   ptcb->args = args;
@@ -57,8 +57,26 @@ typedef struct process_control_block {
   rlnode ptcb_list;
   int thread_count;
 
+  Mutex lock;             /**< @brief Protects @c FIDT, @c ptcb_list, @c thread_count,
+                             @c stats and the PTCBs of the process. */
+
+  sched_stats stats;      /**< @brief CPU accounting of the exited threads of the process */
+
+  int gang;               /**< @brief Set if the threads are gang-scheduled, see @c SetGang() */
+
 } PCB;
 
+/**
+  @brief The process table lock.
+
+  This lock protects the allocation of PCBs, the parent/child relations 
+  (@c parent, @c children_list, @c exited_list), the @c pstate and @c exitval 
+  of each process, and waiting on @c child_exit.
+
+  When both are needed, it is locked before @c PCB.lock.
+ */
+extern Mutex proc_table_lock;
+
 void acquire_ptcb(TCB* tcb, Task task, int argl, void* args);
 void start_main_ptcb_thread();
 void increase_refcount(PTCB* ptcb);
@@ -77,6 +95,16 @@ int procinfo_read(void* pr,char* buf, unsigned int size);
 
 int procinfo_close(void* pr);
 
+typedef struct schedinfo_control_block{
+
+  uint cursor;   /**< @brief The core of the next read */
+
+} SCHEDINF_CB;
+
+int schedinfo_read(void* sr, char* buf, unsigned int size);
+
+int schedinfo_close(void* sr);
+
 /* ========================================== */
 
 
@@ -1,5 +1,7 @@
 #include <assert.h>
+#include <stdio.h>
 #include <sys/mman.h>
+#include <time.h>
 
 #include "kernel_cc.h"
 #include "kernel_proc.h"
@@ -10,10 +12,6 @@
 #include <valgrind/valgrind.h>
 #endif
 
-#define SCHED_QUEUES 10	//number of queues 
-
-int yield_counter;	//every time we yield we add 1
-
 /********************************************
 	
 	Core table and CCB-related declarations.
@@ -37,6 +35,66 @@ CCB cctx[MAX_CORES];
 #define CURTHREAD (CURCORE.current_thread)
 
 
+/********************************************
+	
+	Scheduler event tracing.
+ *********************************************/
+
+#ifdef SCHED_TRACE
+
+typedef enum {
+	TRACE_YIELD,	/* arg is the cause */
+	TRACE_SWITCH,	/* tcb is the next thread, other the previous one */
+	TRACE_WAKEUP,	/* other is the waker */
+	TRACE_SLEEP,	/* arg is the state, timeout the timeout */
+	TRACE_TIMEOUT
+} trace_type;
+
+typedef struct sched_event {
+	TimerDuration time;
+	TCB* tcb;
+	TCB* other;
+	TimerDuration timeout;
+	Pid_t pid;		/* of tcb, or NOPROC for an idle thread; tcb may be gone by the dump */
+	uint8_t type;
+	uint8_t arg;
+} sched_event;
+
+/* 
+	A core records its own events only, even those about the threads of
+	other cores, so only interrupts of the core itself race with it, and
+	a fetch-and-add of the head keeps them apart.
+ */
+static struct sched_trace {
+	unsigned long head;
+	sched_event event[SCHED_TRACE_EVENTS];
+} sched_traces[MAX_CORES];
+
+static void sched_trace(trace_type type, TCB* tcb, int arg, TCB* other, TimerDuration timeout)
+{
+	struct sched_trace* trace = &sched_traces[cpu_core_id];
+	unsigned long i = __atomic_fetch_add(&trace->head, 1, __ATOMIC_RELAXED);
+	sched_event* ev = &trace->event[i & (SCHED_TRACE_EVENTS - 1)];
+
+	ev->time = bios_clock();
+	ev->tcb = tcb;
+	ev->other = other;
+	ev->timeout = timeout;
+	ev->pid = (tcb->type == IDLE_THREAD) ? NOPROC : get_pid(tcb->owner_pcb);
+	ev->type = type;
+	ev->arg = arg;
+}
+
+#define SCHED_TRACE_EVENT(type, tcb, arg, other, timeout) \
+	sched_trace((type), (tcb), (arg), (other), (timeout))
+
+#else
+
+#define SCHED_TRACE_EVENT(type, tcb, arg, other, timeout) do { } while (0)
+
+#endif
+
+
 /*
 	This can be used in the preemptive context to
 	obtain the current thread.
@@ -49,27 +107,133 @@ TCB* cur_thread()
   return cur;
 }
 
+/*
+	The same, with preemption on. We may be moved to another core while we
+	look, so we read the core's switch counter around the read of CURTHREAD.
+	If we were on the same core at both reads of the core id, and the core 
+	did not switch threads in between, we never left it.
+ */
+TCB* cur_thread_fast()
+{
+  while(1) {
+    uint core = cpu_core_id;
+    unsigned long sw = cctx[core].switches;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    TCB* cur = cctx[core].current_thread;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if(cpu_core_id != core)
+      continue;
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+    if(cctx[core].switches == sw)
+      return cur;
+  }
+}
+
+/*
+	Used by adaptive spinning. The handle may belong to an exited thread,
+	so we compare it with the handles of the current threads, rather than
+	reading the TCB of the current thread of another core, which may be 
+	released meanwhile.
+ */
+int sched_handle_running(uintptr_t handle)
+{
+  for(uint core=0; core<cpu_cores(); core++)
+    if(__atomic_load_n(&cctx[core].current_handle, __ATOMIC_RELAXED) == handle)
+      return 1;
+  return 0;
+}
+
+
+/*
+  Thread handles.
+  ---------------
+  A Mutex names its owner by a handle rather than a TCB pointer, because
+  the owner may exit, or return from its task, while it still holds the 
+  mutex. Its TCB is then released, and perhaps recycled for a new thread.
+
+  Handles are serial numbers shifted left by 2, so they leave the low bits
+  of the Mutex word free; they are never reused. The live threads are kept
+  in a hash table by handle. A thread leaves the table just before it
+  exits, so a waiter that looks up the owner of a mutex, under the bucket 
+  lock, either finds a thread that cannot be released before the lock is
+  dropped, or nothing.
+
+  Lock order: futex bucket, then handle bucket, then scheduler locks.
+ */
+#define HANDLE_BUCKETS 64
+
+static struct handle_bucket {
+	Mutex lock;
+	rlnode threads;
+} handle_table[HANDLE_BUCKETS];
+
+static uintptr_t handle_serial = 0;
+
+static inline uintptr_t handle_new()
+{
+	return __atomic_add_fetch(&handle_serial, 1, __ATOMIC_RELAXED) << 2;
+}
+
+/* Lock and return the bucket of handle. Preemption must be off. */
+static struct handle_bucket* handle_lock_bucket(uintptr_t handle)
+{
+	struct handle_bucket* b = &handle_table[(handle >> 2) % HANDLE_BUCKETS];
+	Mutex_Lock(&b->lock);
+	if (b->threads.next == NULL)
+		rlnode_init(&b->threads, NULL);
+	return b;
+}
+
+static void handle_register(TCB* tcb)
+{
+	int preempt = preempt_off;
+	struct handle_bucket* b = handle_lock_bucket(tcb->handle);
+	rlist_push_back(&b->threads, rlnode_init(&tcb->handle_node, tcb));
+	Mutex_Unlock(&b->lock);
+	if (preempt)
+		preempt_on;
+}
+
+/* *** MUST BE CALLED WITH PREEMPTION OFF *** */
+static void handle_unregister(TCB* tcb)
+{
+	struct handle_bucket* b = handle_lock_bucket(tcb->handle);
+	rlist_remove(&tcb->handle_node);
+	Mutex_Unlock(&b->lock);
+}
+
+/* Find the live thread of handle, in the (locked) bucket b */
+static TCB* handle_find(struct handle_bucket* b, uintptr_t handle)
+{
+	for (rlnode* n = b->threads.next; n != &b->threads; n = n->next)
+		if (n->tcb->handle == handle)
+			return n->tcb;
+	return NULL;
+}
+
 
 
 /*
    The thread layout.
   --------------------
-  On the x86 (Pentium) architecture, the stack grows upward. Therefore, we
-  can allocate the TCB at the top of the memory block used as the stack.
+  On the x86 architecture, the stack grows downward. Therefore, we
+  allocate the TCB at the top of the memory block, above the stack.
   +-------------+
   |   TCB       |
   +-------------+
+  | first frame |
+  +-------------+
+  |      |      |
+  |      v      |
   |             |
   |    stack    |
   |             |
-  |      ^      |
-  |      |      |
   +-------------+
-  | first frame |
+  | guard page  |   (only for mmapped thread memory)
   +-------------+
-  Advantages: (a) unified memory area for stack and TCB (b) stack overrun will
-  crash own thread, before it affects other threads (which may make debugging
-  easier).
+  Advantages: (a) unified memory area for stack and TCB (b) with the guard 
+  page, a stack overrun faults deterministically, before it corrupts the
+  memory of other threads.
   Disadvantages: The stack cannot grow unless we move the whole TCB. Of course,
   we do not support stack growth anyway!
  */
@@ -79,7 +243,6 @@ TCB* cur_thread()
   with the exception of idle threads (they don't count).
  */
 volatile unsigned int active_threads = 0;
-Mutex active_threads_spinlock = MUTEX_INIT;
 
 /* This is specific to Intel Pentium! */
 #define SYSTEM_PAGE_SIZE (1 << 12)
@@ -88,283 +251,2022 @@ Mutex active_threads_spinlock = MUTEX_INIT;
 #define THREAD_TCB_SIZE \
 	(((sizeof(TCB) + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE)
 
-#define THREAD_SIZE (THREAD_TCB_SIZE + THREAD_STACK_SIZE)
+/* The unmapped page below the stack of mmapped threads */
+#define THREAD_GUARD_SIZE SYSTEM_PAGE_SIZE
+
+/*
+  If set, thread memory is allocated by mmap, with a guard page below the
+  stack. Else, it is allocated by malloc. It must not change while there
+  are threads, or cached thread blocks, i.e., it should be set before boot().
+ */
+int mmapped_thread_mem = 0;
+
+/*
+  Allocate the memory of a thread with the given stack size, and return
+  the address of its TCB.
+  
+  With mmap, the block is reserved with MAP_NORESERVE, so that only the 
+  pages actually touched take up memory, and the guard page is made 
+  PROT_NONE. 
+  
+  With malloc, allocation is probably faster, but a stack overflow cannot
+  be easily detected.
+ */
+static TCB* allocate_thread(size_t stack_size)
+{
+	void* ptr;
+	size_t size = stack_size + THREAD_TCB_SIZE;
+
+	if (mmapped_thread_mem) {
+		ptr = mmap(NULL, THREAD_GUARD_SIZE + size, PROT_READ | PROT_WRITE,
+			MAP_ANONYMOUS | MAP_PRIVATE | MAP_NORESERVE, -1, 0);
+		CHECK((ptr == MAP_FAILED) ? -1 : 0);
+		CHECK(mprotect(ptr, THREAD_GUARD_SIZE, PROT_NONE));
+		ptr += THREAD_GUARD_SIZE;
+	} else {
+		ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
+		CHECK((ptr == NULL) ? -1 : 0);
+	}
+
+	TCB* tcb = (TCB*)(ptr + stack_size);
+	tcb->stack_size = stack_size;
+	return tcb;
+}
+
+/* Return the bottom of the stack segment of a thread */
+static inline void* thread_stack(TCB* tcb)
+{
+	return ((void*)tcb) - tcb->stack_size;
+}
+
+/* Free the memory of a thread */
+static void free_thread(TCB* tcb)
+{
+	if (mmapped_thread_mem) {
+		CHECK(munmap(thread_stack(tcb) - THREAD_GUARD_SIZE, 
+			THREAD_GUARD_SIZE + tcb->stack_size + THREAD_TCB_SIZE));
+	} else
+		free(thread_stack(tcb));
+}
+
+
+/*
+  Thread blocks are recycled through a per-core cache, so that thread churn
+  does not go through the allocator, and reuses memory that is already 
+  faulted in. The cache is only touched by its own core, with preemption 
+  off, so it needs no lock. Only blocks with the default stack size are
+  cached.
+ */
+unsigned int thread_cache_limit = 16;
+
+static TCB* thread_cache_get(size_t stack_size)
+{
+	if (stack_size != THREAD_STACK_SIZE)
+		return allocate_thread(stack_size);
+
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+
+	TCB* tcb = ccb->thread_cache;
+	if (tcb != NULL) {
+		ccb->thread_cache = *(TCB**)tcb;
+		ccb->thread_cache_count--;
+	}
+
+	if (preempt)
+		preempt_on;
+
+	return (tcb != NULL) ? tcb : allocate_thread(stack_size);
+}
+
+/* *** MUST BE CALLED WITH PREEMPTION OFF *** */
+static void thread_cache_put(TCB* tcb)
+{
+	CCB* ccb = &CURCORE;
+
+	if (tcb->stack_size == THREAD_STACK_SIZE && ccb->thread_cache_count < thread_cache_limit) {
+		/* Give back the pages of an mmapped stack; they are zero-filled on the next touch */
+		if (mmapped_thread_mem) {
+			CHECK(madvise(thread_stack(tcb), tcb->stack_size, MADV_DONTNEED));
+		}
+
+		*(TCB**)tcb = ccb->thread_cache;
+		ccb->thread_cache = tcb;
+		ccb->thread_cache_count++;
+	} else
+		free_thread(tcb);
+}
+
+/* Free the thread cache of the current core */
+static void thread_cache_drain()
+{
+	CCB* ccb = &CURCORE;
+
+	while (ccb->thread_cache != NULL) {
+		TCB* tcb = ccb->thread_cache;
+		ccb->thread_cache = *(TCB**)tcb;
+		free_thread(tcb);
+	}
+	ccb->thread_cache_count = 0;
+}
+
+
+/*
+  This is the function that is used to start normal threads.
+*/
+
+void gain(int preempt); /* forward */
+static uint sched_least_loaded_core(coremask_t mask); /* forward */
+static void sched_inbox_drain(CCB* ccb); /* forward */
+static int sched_rt_preempts(CCB* ccb); /* forward */
+static int sched_gang_preempts(CCB* ccb); /* forward */
+static int sched_rt_before(TCB* a, TCB* b); /* forward */
+static TCB* sched_gang_steal(CCB* ccb, PCB* pcb); /* forward */
+
+/*
+  The clock of the scheduler, in microseconds. bios_clock() reads the 
+  coarse realtime clock, which ticks every few milliseconds and may step
+  backwards. That is too coarse for time-slices shorter than its tick, 
+  and for latencies, so the scheduler reads the monotonic clock.
+*/
+static inline TimerDuration sched_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000ull + ts.tv_nsec / 1000;
+}
+
+/* The cores tcb may be queued on. An RT_EDF thread stays on the core that admitted it. */
+static inline coremask_t sched_mask(TCB* tcb)
+{
+	return (tcb->rt_policy == RT_EDF) ? (1u << tcb->rt_core) : tcb->affinity;
+}
+
+static void thread_start()
+{
+	gain(1);
+	cur_thread()->thread_func();
+
+	/* We are not supposed to get here! */
+	assert(0);
+}
+
+/*
+  Initialize and return a new TCB
+*/
+
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size)
+{
+	/* The allocated thread size must be a multiple of page size */
+	if (stack_size == 0)
+		stack_size = THREAD_STACK_SIZE;
+	else if (stack_size < THREAD_STACK_MIN)
+		stack_size = THREAD_STACK_MIN;
+	else if (stack_size > THREAD_STACK_MAX)
+		stack_size = THREAD_STACK_MAX;
+	stack_size = ((stack_size + SYSTEM_PAGE_SIZE - 1) / SYSTEM_PAGE_SIZE) * SYSTEM_PAGE_SIZE;
+
+	TCB* tcb = thread_cache_get(stack_size);
+
+	/* Set the owner */
+	tcb->owner_pcb = pcb;
+
+	/* Initialize the other attributes */
+	tcb->ptcb = NULL;
+	tcb->handle = handle_new();
+	tcb->priority = SCHED_QUEUES/2;	//starting with the priority of the middle queue
+	tcb->pi_saved = -1;
+	tcb->pi_count = 0;
+	tcb->pi_extra = -1;
+	tcb->type = NORMAL_THREAD;
+	tcb->state = INIT;
+	tcb->phase = CTX_CLEAN;
+	tcb->thread_func = func;
+	tcb->wakeup_time = NO_TIMEOUT;
+	tcb->affinity = ALL_CORES;
+	tcb->core = sched_least_loaded_core(tcb->affinity);
+	tcb->inbox_next = NULL;
+	tcb->on_queue = 0;
+	tcb->vruntime = 0;
+	tcb->fair_child = tcb->fair_sibling = tcb->fair_prev = NULL;
+	tcb->rt_policy = RT_NONE;
+	tcb->gang = 0;
+	tcb->stats = (sched_stats) { 0 };
+	tcb->blocked_since = 0;
+	tcb->ready_since = tcb->woken_at = 0;
+	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+
+	tcb->burst = QUANTUM/2;
+	tcb->its = QUANTUM;
+	tcb->rts = QUANTUM;
+	tcb->last_cause = SCHED_IDLE;
+	tcb->curr_cause = SCHED_IDLE;
+
+	/* Compute the stack segment address and size */
+	void* sp = thread_stack(tcb);
+
+	/* Init the context */
+	cpu_initialize_context(&tcb->context, sp, tcb->stack_size, thread_start);
+
+#ifndef NVALGRIND
+	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + tcb->stack_size);
+#endif
+
+	/* increase the count of active threads */
+	__atomic_add_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+
+	handle_register(tcb);
+
+	return tcb;
+}
+
+/*
+  This is called with the sched_lock of the current core locked !
+ */
+void release_TCB(TCB* tcb)
+{
+#ifndef NVALGRIND
+	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
+#endif
+
+	thread_cache_put(tcb);
+
+	__atomic_sub_fetch(&active_threads, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ *
+ * Scheduler
+ *
+ */
+
+/*
+ *  Note: the scheduler routines are all in the non-preemptive domain.
+ */
+
+/*
+  Each core owns SCHED_QUEUES ready queues (one per priority level) and a 
+  timer wheel of its threads sleeping with a timeout. 
+  Both of these structures are protected by the core's sched_lock. 
+
+  A thread is owned by the core in tcb->core. The field is only changed 
+  while holding the owner's lock, so sched_lock_tcb() can lock the owner 
+  of any thread without a global lock. A core whose queues are empty 
+  steals work from the busiest peer.
+*/
+
+/*
+  In tickless mode, a core whose current thread has no competition (it is 
+  the idle thread, or nothing else is ready on the core) does not take 
+  an ALARM every quantum. Instead, the timer is armed for the next timeout 
+  in the core's timer wheel, or not at all. When a thread is added to the 
+  queues of a tickless core, the quantum timer is armed again; for a remote 
+  core, this is done by sending it an ICI.
+
+  Comment out to arm the timer every quantum.
+*/
+#define SCHED_TICKLESS
+
+/*
+  The sched_lock of each core is an MCS lock. The current core queues on 
+  its own node for the lock of ccb; since a core never holds the same lock
+  twice, the node is free, and the scheduler locks are only held with 
+  preemption off, so the current core cannot change before the unlock.
+  Locking is a macro, so that LOCK_PROFILING charges the caller.
+*/
+#define sched_lock_core(ccb) \
+	McsLock_Lock(&(ccb)->sched_lock, &CURCORE.sched_lock_node[(ccb)->id])
+
+static inline int sched_trylock_core(CCB* ccb)
+{
+	return McsLock_TryLock(&ccb->sched_lock, &CURCORE.sched_lock_node[ccb->id]);
+}
+
+static inline void sched_unlock_core(CCB* ccb)
+{
+	McsLock_Unlock(&ccb->sched_lock, &CURCORE.sched_lock_node[ccb->id]);
+}
+
+/* Interrupt handler for ALARM */
+void yield_handler() { yield(SCHED_QUANTUM); }
+
+/* Interrupt handle for inter-core interrupts */
+void ici_handler()
+{
+	/* Another core woke up a thread of ours, or added work to our queues, 
+	   while we were tickless. We may also have interrupted ourselves. */
+	int preempt = preempt_off;
+	CCB* ccb = &CURCORE;
+
+	sched_lock_core(ccb);
+	sched_inbox_drain(ccb);
+	int kick = ccb->tickless && ccb->ready_count > 0;
+	if (kick)
+		ccb->tickless = 0;
+
+	/* Or queued a real-time thread that should preempt the current thread,
+	   or opened a gang slot */
+	int resched = sched_rt_preempts(ccb) || sched_gang_preempts(ccb);
+	int idle = ccb->current_thread != NULL && ccb->current_thread->type == IDLE_THREAD;
+
+	/* Or woke up an interactive thread; cut a long slice down to QUANTUM */
+	TimerDuration cut = NO_TIMEOUT;
+	TCB* current = ccb->current_thread;
+	if (current != NULL && current->its > QUANTUM && ccb->ready_count > 0) {
+		TimerDuration ran = sched_clock() - ccb->slice_start;
+		cut = (ran < QUANTUM) ? QUANTUM - ran : 0;
+	}
+	sched_unlock_core(ccb);
+
+	if (resched)
+		yield(idle ? SCHED_IDLE : SCHED_USER);
+	else if (cut == 0)
+		yield(SCHED_QUANTUM);
+	else if (cut != NO_TIMEOUT) {
+		TimerDuration remaining = bios_cancel_timer();
+		bios_set_timer((remaining != 0 && remaining < cut) ? remaining : cut);
+	}
+	else if (kick)
+		bios_set_timer(QUANTUM);
+
+	if (preempt)
+		preempt_on;
+}
+
+/*
+  Lock and return the core that owns tcb. 
+  *** MUST BE CALLED WITH PREEMPTION OFF ***
+*/
+static CCB* sched_lock_tcb(TCB* tcb)
+{
+	while (1) {
+		CCB* ccb = &cctx[tcb->core];
+		sched_lock_core(ccb);
+		/* The owner may have changed while we were spinning */
+		if (tcb->core == ccb->id)
+			return ccb;
+		sched_unlock_core(ccb);
+	}
+}
+
+/*
+  Return the core in mask with the fewest ready threads, preferring the 
+  current one. The ready counts are read without locking, so this is 
+  only a hint. mask must contain an existing core.
+*/
+static uint sched_least_loaded_core(coremask_t mask)
+{
+	uint best = cpu_core_id;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if ((mask & (1u << c)) && 
+			(!(mask & (1u << best)) || cctx[c].ready_count < cctx[best].ready_count))
+			best = c;
+	return best;
+}
+
+/*
+  The timer wheel.
+
+  Timeouts are kept in ticks of 2^TIMER_TICK_SHIFT usec, rounding the
+  wakeup time up, so that a thread is never woken up early. Level l of
+  the wheel holds the timeouts which agree with timer_tick on all bits 
+  above level l, but not on the bits of level l; they are in the slot 
+  given by these bits. As time goes by, the slot of level l that becomes 
+  current is cascaded to the lower levels, and level 0 is expired.
+
+  Insertion and cancellation are O(1). Cancellation just unlinks the 
+  node, leaving a possibly stale bit in timer_mask, which is cleared
+  when the slot is visited.
+*/
+
+/* Return the tick at which tcb must be woken up */
+static inline TimerDuration timer_expiry_tick(TCB* tcb)
+{
+	return (tcb->wakeup_time + (1ul << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+}
+
+/*
+  Insert tcb in the wheel of ccb.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void timer_wheel_insert(CCB* ccb, TCB* tcb)
+{
+	TimerDuration tick = timer_expiry_tick(tcb);
+	if (tick < ccb->timer_tick)
+		tick = ccb->timer_tick;
+
+	for (uint l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		uint shift = TIMER_WHEEL_BITS * (l + 1);
+		if ((tick >> shift) == (ccb->timer_tick >> shift)) {
+			uint slot = (tick >> (shift - TIMER_WHEEL_BITS)) & (TIMER_WHEEL_SLOTS - 1);
+			rlist_push_back(&ccb->timer_wheel[l][slot], &tcb->sched_node);
+			ccb->timer_mask[l] |= 1ull << slot;
+			return;
+		}
+	}
+
+	rlist_push_back(&ccb->timer_overflow, &tcb->sched_node);
+}
+
+/*
+  Re-insert the threads of list into the wheel, since timer_tick has moved.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void timer_wheel_cascade(CCB* ccb, rlnode* list)
+{
+	rlnode pending;
+	rlnode_init(&pending, NULL);
+	rlist_append(&pending, list);
+
+	while (!is_rlist_empty(&pending))
+		timer_wheel_insert(ccb, rlist_pop_front(&pending)->tcb);
+}
+
+/*
+  Return the first tick in [ccb->timer_tick, limit] which either has 
+  a (possibly stale) level-0 slot, or needs a cascade. Return limit+1 
+  if there is none.
+*/
+static TimerDuration timer_wheel_next_tick(CCB* ccb, TimerDuration limit)
+{
+	TimerDuration tick = ccb->timer_tick;
+	uint slot = tick & (TIMER_WHEEL_SLOTS - 1);
+
+	/* The slot is current, if it is marked or we are at a cascade boundary */
+	uint64_t pending = ccb->timer_mask[0] >> slot;
+	TimerDuration next = pending ? tick + __builtin_ctzll(pending) 
+		: (tick | (TIMER_WHEEL_SLOTS - 1)) + 1;
+	if (slot == 0)
+		next = tick;
+
+	return (next > limit) ? limit + 1 : next;
+}
+
+#ifdef SCHED_TICKLESS
+/*
+  Return the earliest tick at which the wheel of ccb has work to do (an 
+  expiry or a cascade), or NO_TIMEOUT if the wheel is empty. Stale mask 
+  bits may make this earlier than needed, but never later.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static TimerDuration timer_wheel_deadline(CCB* ccb)
+{
+	TimerDuration tick = ccb->timer_tick;
+	TimerDuration deadline = NO_TIMEOUT;
+
+	/* 
+		A slot at the current tick of an upper level may still be waiting 
+		for its cascade, so the earliest slot of every level is considered.
+	 */
+	for (uint l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+		uint shift = TIMER_WHEEL_BITS * l;
+		uint slot = (tick >> shift) & (TIMER_WHEEL_SLOTS - 1);
+
+		/* Unless tick is at its start, the current slot of an upper level is done */
+		uint first = (tick & ((1ull << shift) - 1)) ? slot + 1 : slot;
+		uint64_t pending = (first == TIMER_WHEEL_SLOTS) ? 0 : ccb->timer_mask[l] >> first;
+		if (pending) {
+			uint next = first + __builtin_ctzll(pending);
+			TimerDuration t = (next == slot) ? tick
+				: ((tick >> (shift + TIMER_WHEEL_BITS)) << (shift + TIMER_WHEEL_BITS)) | ((TimerDuration)next << shift);
+			if (t < deadline)
+				deadline = t;
+		}
+	}
+
+	if (!is_rlist_empty(&ccb->timer_overflow)) {
+		uint shift = TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS;
+		TimerDuration t = (tick & ((1ull << shift) - 1)) ? ((tick >> shift) + 1) << shift : tick;
+		if (t < deadline)
+			deadline = t;
+	}
+
+	return deadline;
+}
+#endif
+
+/*
+  Possibly add TCB to the timer wheel of its core.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_register_timeout(CCB* ccb, TCB* tcb, TimerDuration timeout)
+{
+	if (timeout != NO_TIMEOUT) {
+		/* set the wakeup time */
+		TimerDuration curtime = bios_clock();
+		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+
+		/* add to the wheel */
+		timer_wheel_insert(ccb, tcb);
+	}
+}
+
+/*
+  Scheduler classes.
+
+  The order of the ready threads of each core is up to the scheduler 
+  class selected at boot. The generic code below keeps the ready count,
+  the affinity and ownership of threads, and calls the class through 
+  sched_class.
+*/
+
+/*
+  The MLFQ class.
+
+  Each core has SCHED_QUEUES ready queues, one per priority level, and 
+  runs the head of the highest non-empty one. A thread that uses up its
+  quantum, or blocks on a Mutex, drops a level; a thread that blocks for
+  I/O rises a level. Every 2000 yields, all the ready threads of the core
+  rise a level, to avoid starvation.
+*/
+
+/*
+  Return the ready queue of priority level 'level' on ccb.
+
+  The top level has a fixed slot. The lower levels rotate over the other
+  slots, so that a boost raises all of them by shifting boost_base, without
+  touching the queued threads.
+*/
+static inline rlnode* sched_level_queue(CCB* ccb, uint level)
+{
+	if (level == SCHED_QUEUES - 1)
+		return &ccb->ready_queue[level];
+	return &ccb->ready_queue[(level + ccb->boost_base) % (SCHED_QUEUES - 1)];
+}
+
+/*
+  Return the level of the ready queue that holds tcb on ccb. Since boosts 
+  do not touch queued threads, tcb->priority may be stale, so we walk the
+  ring of tcb up to the queue head, and undo the rotation of its slot.
+*/
+static uint sched_queue_level(CCB* ccb, TCB* tcb)
+{
+	rlnode* n = tcb->sched_node.next;
+	while (n < ccb->ready_queue || n >= ccb->ready_queue + SCHED_QUEUES)
+		n = n->next;
+
+	uint slot = n - ccb->ready_queue;
+	if (slot == SCHED_QUEUES - 1)
+		return slot;
+	return (slot + (SCHED_QUEUES - 1) - ccb->boost_base) % (SCHED_QUEUES - 1);
+}
+
+/*
+  Return the highest priority level of ccb with ready threads.
+  ccb->ready_mask must not be 0.
+*/
+static inline uint sched_top_level(CCB* ccb)
+{
+	return 31 - __builtin_clz(ccb->ready_mask);
+}
+
+/*
+  Raise the priority of every ready thread of ccb by one level, to avoid 
+  starvation. Threads at the top level stay there.
+
+  This is O(1): the level below the top is merged into the top queue, and
+  the rotation of the lower levels moves by one, so that each lower queue 
+  now serves the level above its old one and the emptied queue becomes 
+  level 0. The queued threads pick up their new priority when removed.
+*/
+static void boost(CCB* ccb)
+{
+	const uint top = SCHED_QUEUES - 1;
+
+	rlist_append(sched_level_queue(ccb, top), sched_level_queue(ccb, top - 1));
+	ccb->boost_base = (ccb->boost_base + top - 1) % top;
+	ccb->ready_mask = ((ccb->ready_mask << 1) | (ccb->ready_mask & (1u << top))) & ((1u << SCHED_QUEUES) - 1);
+}
+
+static void mlfq_init(CCB* ccb)
+{
+	for (int i = 0; i < SCHED_QUEUES; i++)
+		rlnode_init(&ccb->ready_queue[i], NULL);
+	ccb->ready_mask = 0;
+	ccb->boost_base = 0;
+	ccb->yield_counter = 0;
+}
+
+/* Add tcb to the end of the ready queue of its level */
+static void mlfq_enqueue(CCB* ccb, TCB* tcb)
+{
+	rlist_push_back(sched_level_queue(ccb, tcb->priority), &tcb->sched_node);
+	ccb->ready_mask |= 1u << tcb->priority;
+}
+
+/*
+  Remove tcb from the ready queue of 'level'. The thread may have been 
+  boosted while queued, so its priority becomes the level it was at.
+*/
+static TCB* mlfq_remove(CCB* ccb, uint level, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	if (is_rlist_empty(sched_level_queue(ccb, level)))
+		ccb->ready_mask &= ~(1u << level);
+
+	tcb->priority = level;
+	return tcb;
+}
+
+static void mlfq_dequeue(CCB* ccb, TCB* tcb)
+{
+	mlfq_remove(ccb, sched_queue_level(ccb, tcb), tcb);
+}
+
+/* Remove the head of the highest non-empty ready queue */
+static TCB* mlfq_pick_next(CCB* ccb)
+{
+	if (ccb->ready_mask == 0)
+		return NULL;
+
+	uint level = sched_top_level(ccb);
+	return mlfq_remove(ccb, level, sched_level_queue(ccb, level)->next->tcb);
+}
+
+/*
+  Take the thread that the victim would run last in its top level, 
+  skipping the threads that may not run on ccb.
+*/
+static TCB* mlfq_steal(CCB* victim, CCB* ccb)
+{
+	for (uint mask = victim->ready_mask; mask != 0; ) {
+		uint level = 31 - __builtin_clz(mask);
+		rlnode* q = sched_level_queue(victim, level);
+		for (rlnode* n = q->prev; n != q; n = n->prev)
+			if (sched_mask(n->tcb) & (1u << ccb->id))
+				return mlfq_remove(victim, level, n->tcb);
+		mask &= ~(1u << level);
+	}
+	return NULL;
+}
+
+static void mlfq_tick(CCB* ccb, TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	if (++ccb->yield_counter > 2000) {
+		boost(ccb);
+		ccb->yield_counter = 0;
+	}
+
+	/* A thread that used up its quantum is CPU-bound */
+	if (cause == SCHED_QUANTUM && tcb->priority > 0)
+		tcb->priority--;
+}
+
+static void mlfq_on_block(CCB* ccb, TCB* tcb, enum SCHED_CAUSE cause)
+{
+	switch (cause) {
+	case SCHED_IO:
+		if (tcb->priority < SCHED_QUEUES - 1)
+			tcb->priority++;
+		break;
+	case SCHED_MUTEX:
+		if (tcb->priority > 0)
+			tcb->priority--;
+		break;
+	default:
+		break;
+	}
+}
+
+static const SchedClass mlfq_class = {
+	.name = "mlfq",
+	.init = mlfq_init,
+	.enqueue = mlfq_enqueue,
+	.dequeue = mlfq_dequeue,
+	.pick_next = mlfq_pick_next,
+	.steal = mlfq_steal,
+	.tick = mlfq_tick,
+	.on_block = mlfq_on_block,
+	.migrate = NULL
+};
+
+/*
+  The fair class.
+
+  As in CFS, each thread accumulates a virtual runtime: the time it ran,
+  scaled by the inverse of the weight of its priority. Each core runs the
+  ready thread with the least vruntime. The ready threads are kept in a 
+  pairing heap, linked through the TCBs, so that nothing is allocated 
+  under the scheduler lock.
+
+  A thread that was asleep is placed at most FAIR_SLEEPER_CREDIT behind
+  min_vruntime, so that sleepers get a bounded head start. A thread that
+  moves to another core keeps its distance from min_vruntime.
+*/
+
+#define FAIR_SLEEPER_CREDIT (QUANTUM)
+
+/* Weight of each priority level; every level gets 25% more CPU than the one below */
+static const uint fair_weight[SCHED_QUEUES] = {
+	335, 423, 526, 655, 820, 1024, 1277, 1586, 1991, 2501
+};
+_Static_assert(SCHED_QUEUES == 10, "fair_weight needs one entry per priority level");
+
+/* Meld two heaps whose roots have no siblings, and return the root */
+static TCB* fair_meld(TCB* a, TCB* b)
+{
+	if (a == NULL)
+		return b;
+	if (b == NULL)
+		return a;
+	if (b->vruntime < a->vruntime) {
+		TCB* t = a;
+		a = b;
+		b = t;
+	}
+
+	/* b becomes the first child of a */
+	b->fair_sibling = a->fair_child;
+	if (a->fair_child != NULL)
+		a->fair_child->fair_prev = b;
+	b->fair_prev = a;
+	a->fair_child = b;
+	return a;
+}
+
+/* Meld a list of siblings into one heap, in two passes, and return the root */
+static TCB* fair_meld_siblings(TCB* first)
+{
+	/* Meld pairs left to right, stacking the results */
+	TCB* pairs = NULL;
+	while (first != NULL) {
+		TCB* a = first;
+		TCB* b = a->fair_sibling;
+		first = (b != NULL) ? b->fair_sibling : NULL;
+
+		a->fair_sibling = a->fair_prev = NULL;
+		if (b != NULL)
+			b->fair_sibling = b->fair_prev = NULL;
+
+		TCB* m = fair_meld(a, b);
+		m->fair_sibling = pairs;
+		pairs = m;
+	}
+
+	/* Meld the stack right to left */
+	TCB* root = NULL;
+	while (pairs != NULL) {
+		TCB* next = pairs->fair_sibling;
+		pairs->fair_sibling = NULL;
+		root = fair_meld(root, pairs);
+		pairs = next;
+	}
+	return root;
+}
+
+static void fair_init(CCB* ccb)
+{
+	ccb->fair_root = NULL;
+	ccb->min_vruntime = 0;
+}
+
+static void fair_enqueue(CCB* ccb, TCB* tcb)
+{
+	TimerDuration floor = (ccb->min_vruntime > FAIR_SLEEPER_CREDIT) 
+		? ccb->min_vruntime - FAIR_SLEEPER_CREDIT : 0;
+	if (tcb->vruntime < floor)
+		tcb->vruntime = floor;
+
+	tcb->fair_child = tcb->fair_sibling = tcb->fair_prev = NULL;
+	ccb->fair_root = fair_meld(ccb->fair_root, tcb);
+}
+
+static void fair_dequeue(CCB* ccb, TCB* tcb)
+{
+	TCB* rest = fair_meld_siblings(tcb->fair_child);
+	tcb->fair_child = NULL;
+
+	if (tcb == ccb->fair_root) {
+		ccb->fair_root = rest;
+		return;
+	}
+
+	/* Unlink tcb from its parent or left sibling */
+	if (tcb->fair_prev->fair_child == tcb)
+		tcb->fair_prev->fair_child = tcb->fair_sibling;
+	else
+		tcb->fair_prev->fair_sibling = tcb->fair_sibling;
+	if (tcb->fair_sibling != NULL)
+		tcb->fair_sibling->fair_prev = tcb->fair_prev;
+	tcb->fair_sibling = tcb->fair_prev = NULL;
+
+	ccb->fair_root = fair_meld(ccb->fair_root, rest);
+}
+
+static TCB* fair_pick_next(CCB* ccb)
+{
+	TCB* tcb = ccb->fair_root;
+	if (tcb == NULL)
+		return NULL;
+
+	fair_dequeue(ccb, tcb);
+	if (tcb->vruntime > ccb->min_vruntime)
+		ccb->min_vruntime = tcb->vruntime;
+	return tcb;
+}
+
+/* Take the root, or one of its children, if it may run on ccb */
+static TCB* fair_steal(CCB* victim, CCB* ccb)
+{
+	TCB* tcb = victim->fair_root;
+	if (tcb != NULL && !(sched_mask(tcb) & (1u << ccb->id)))
+		for (tcb = tcb->fair_child; tcb != NULL; tcb = tcb->fair_sibling)
+			if (sched_mask(tcb) & (1u << ccb->id))
+				break;
+
+	if (tcb != NULL)
+		fair_dequeue(victim, tcb);
+	return tcb;
+}
+
+static void fair_tick(CCB* ccb, TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	if (tcb->type == IDLE_THREAD)
+		return;
+
+	tcb->vruntime += ran * fair_weight[SCHED_QUEUES/2] / fair_weight[tcb->priority];
+
+	/* min_vruntime follows the least of the current thread and the queued ones */
+	TimerDuration least = tcb->vruntime;
+	if (ccb->fair_root != NULL && ccb->fair_root->vruntime < least)
+		least = ccb->fair_root->vruntime;
+	if (least > ccb->min_vruntime)
+		ccb->min_vruntime = least;
+}
+
+static void fair_migrate(CCB* from, CCB* to, TCB* tcb)
+{
+	/* The min_vruntime of from is only a hint here, as we may not hold its lock */
+	int64_t lag = (int64_t)(tcb->vruntime - from->min_vruntime);
+	int64_t vruntime = (int64_t)to->min_vruntime + lag;
+	tcb->vruntime = (vruntime > 0) ? vruntime : 0;
+}
+
+static const SchedClass fair_class = {
+	.name = "fair",
+	.init = fair_init,
+	.enqueue = fair_enqueue,
+	.dequeue = fair_dequeue,
+	.pick_next = fair_pick_next,
+	.steal = fair_steal,
+	.tick = fair_tick,
+	.on_block = NULL,
+	.migrate = fair_migrate
+};
+
+/*
+  The real-time class.
+
+  Real-time threads are scheduled above the class selected at boot, 
+  whatever that is. RT_EDF threads come first, by earliest deadline, and
+  then RT_FIFO threads, by priority. The real-time threads of a core may
+  use at most RT_RUNTIME usec in every window of RT_PERIOD usec; beyond
+  that, the class is throttled until the window ends.
+
+  An RT_EDF thread has a budget per period, and its deadline is the end
+  of the period. When the budget runs out, yield() puts the thread to 
+  sleep in the timer wheel until the deadline, and the budget is renewed
+  when it is queued again. RT_EDF threads are admitted on a core only if
+  their utilizations add up to at most RT_RUNTIME/RT_PERIOD, and they
+  stay there.
+
+  Windows, deadlines and the runtime charged against them are all read 
+  from sched_clock(), so that budgets shorter than a tick of bios_clock()
+  are enforced.
+*/
+
+/* Largest total utilization of the RT_EDF threads of a core, in millionths */
+#define RT_UTIL_MAX ((uint)(1000000ull * RT_RUNTIME / RT_PERIOD))
+
+static void rt_init(CCB* ccb)
+{
+	for (int i = 0; i < RT_PRIORITIES; i++)
+		rlnode_init(&ccb->rt_queue[i], NULL);
+	ccb->rt_mask = 0;
+	rlnode_init(&ccb->rt_edf, NULL);
+	ccb->rt_count = 0;
+	ccb->rt_window = sched_clock();
+	ccb->rt_runtime = 0;
+	ccb->rt_util = 0;
+}
+
+static void rt_enqueue(CCB* ccb, TCB* tcb)
+{
+	if (tcb->rt_policy == RT_FIFO) {
+		rlist_push_back(&ccb->rt_queue[tcb->rt_priority], &tcb->sched_node);
+		ccb->rt_mask |= 1u << tcb->rt_priority;
+	} else {
+		/* A new period starts when the last one has passed */
+		TimerDuration now = sched_clock();
+		if (now >= tcb->rt_deadline) {
+			tcb->rt_deadline = now + tcb->rt_period;
+			tcb->rt_left = tcb->rt_budget;
+		}
+
+		/* Insert by deadline; there are few real-time threads */
+		rlnode* n = ccb->rt_edf.prev;
+		while (n != &ccb->rt_edf && n->tcb->rt_deadline > tcb->rt_deadline)
+			n = n->prev;
+		rl_splice(n, &tcb->sched_node);
+	}
+	ccb->rt_count++;
+}
+
+static void rt_dequeue(CCB* ccb, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	if (tcb->rt_policy == RT_FIFO && is_rlist_empty(&ccb->rt_queue[tcb->rt_priority]))
+		ccb->rt_mask &= ~(1u << tcb->rt_priority);
+	ccb->rt_count--;
+}
+
+/* Return the real-time thread that ccb should run next, without removing it */
+static TCB* rt_peek(CCB* ccb)
+{
+	if (!is_rlist_empty(&ccb->rt_edf))
+		return ccb->rt_edf.next->tcb;
+	if (ccb->rt_mask != 0)
+		return ccb->rt_queue[31 - __builtin_clz(ccb->rt_mask)].next->tcb;
+	return NULL;
+}
+
+static TCB* rt_pick_next(CCB* ccb)
+{
+	TCB* tcb = rt_peek(ccb);
+	if (tcb != NULL)
+		rt_dequeue(ccb, tcb);
+	return tcb;
+}
+
+/* RT_EDF threads stay on their core, so only RT_FIFO threads are stolen */
+static TCB* rt_steal(CCB* victim, CCB* ccb)
+{
+	for (uint mask = victim->rt_mask; mask != 0; ) {
+		uint prio = 31 - __builtin_clz(mask);
+		rlnode* q = &victim->rt_queue[prio];
+		for (rlnode* n = q->prev; n != q; n = n->prev)
+			if (sched_mask(n->tcb) & (1u << ccb->id)) {
+				rt_dequeue(victim, n->tcb);
+				return n->tcb;
+			}
+		mask &= ~(1u << prio);
+	}
+	return NULL;
+}
+
+static void rt_tick(CCB* ccb, TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran)
+{
+	if (tcb->rt_policy == RT_EDF)
+		tcb->rt_left -= ran;
+}
+
+static const SchedClass rt_class = {
+	.name = "rt",
+	.init = rt_init,
+	.enqueue = rt_enqueue,
+	.dequeue = rt_dequeue,
+	.pick_next = rt_pick_next,
+	.steal = rt_steal,
+	.tick = rt_tick,
+	.on_block = NULL,
+	.migrate = NULL
+};
+
+/*
+  Return 1 if the real-time threads of ccb have used up the current 
+  window, starting a new window if the current one is over.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static int sched_rt_throttled(CCB* ccb)
+{
+	TimerDuration now = sched_clock();
+	if (now - ccb->rt_window >= RT_PERIOD) {
+		ccb->rt_window = now;
+		ccb->rt_runtime = 0;
+	}
+	return ccb->rt_runtime >= RT_RUNTIME;
+}
+
+/*
+  Return 1 if a ready real-time thread of ccb should preempt its current 
+  thread. The idle thread yields by itself.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static int sched_rt_preempts(CCB* ccb)
+{
+	TCB* current = ccb->current_thread;
+	if (ccb->rt_count == 0 || current == NULL || current->type == IDLE_THREAD)
+		return 0;
+	return !sched_rt_throttled(ccb) && sched_rt_before(rt_peek(ccb), current);
+}
+
+/* Return the utilization of an RT_EDF thread, in millionths */
+static inline uint sched_rt_util(TimerDuration budget, TimerDuration period)
+{
+	return (uint)(1000000ull * budget / period);
+}
+
+/*
+  Admit a utilization of util on the core of mask with the least 
+  RT_EDF utilization. Return the core, or -1 if it does not fit.
+*/
+static int sched_rt_admit(coremask_t mask, uint util)
+{
+	int best = -1;
+	for (uint c = 0; c < cpu_cores(); c++)
+		if ((mask & (1u << c)) && (best < 0 || cctx[c].rt_util < cctx[best].rt_util))
+			best = c;
+	if (best < 0)
+		return -1;
+
+	uint old = __atomic_load_n(&cctx[best].rt_util, __ATOMIC_RELAXED);
+	do {
+		if (old + util > RT_UTIL_MAX)
+			return -1;
+	} while (!__atomic_compare_exchange_n(&cctx[best].rt_util, &old, old + util, 
+		1, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+	return best;
+}
+
+/* Give back the utilization admitted for tcb, if it is an RT_EDF thread */
+static void sched_rt_release(TCB* tcb)
+{
+	if (tcb->rt_policy == RT_EDF)
+		__atomic_sub_fetch(&cctx[tcb->rt_core].rt_util, 
+			sched_rt_util(tcb->rt_budget, tcb->rt_period), __ATOMIC_RELAXED);
+}
+
+/* Return 1 if a thread a should preempt a running thread b */
+static int sched_rt_before(TCB* a, TCB* b)
+{
+	if (a->rt_policy == RT_NONE || b->type == IDLE_THREAD)
+		return a->rt_policy != RT_NONE;
+	if (b->rt_policy == RT_NONE)
+		return 1;
+	if (a->rt_policy != b->rt_policy)
+		return a->rt_policy == RT_EDF;
+	if (a->rt_policy == RT_EDF)
+		return a->rt_deadline < b->rt_deadline;
+	return a->rt_priority > b->rt_priority;
+}
+
+/*
+  The gang class.
+
+  The threads of a process marked by SetGang() are queued in the gang 
+  queue of their core. While a gang slot is open, the cores run the 
+  threads of its process before all other threads except real-time ones,
+  taking them from the gang queues of their peers if they have none; 
+  the cores that run something else are interrupted when the slot opens.
+  A slot lasts a QUANTUM, and the next one opens at least a QUANTUM 
+  after it ends, so that the other threads are not starved. Outside the
+  slots, gang threads only run on cores that have nothing else to do.
+*/
+
+static struct {
+	PCB* pcb;		/* The process of the last slot, or NULL once it is gone */
+	TimerDuration end;	/* The end of the last slot */
+	TimerDuration rest;	/* No slot opens before this */
+} gang_slot;
+
+/* Serializes the opening of slots */
+static McsLock gang_lock = MCS_LOCK_INIT;
+
+/* Return the process of the open slot, or NULL */
+static inline PCB* sched_gang_active(TimerDuration now)
+{
+	PCB* pcb = __atomic_load_n(&gang_slot.pcb, __ATOMIC_ACQUIRE);
+	return (pcb != NULL && now < gang_slot.end) ? pcb : NULL;
+}
+
+/* Return 1 if tcb belongs to the gang of pcb */
+static inline int sched_gang_member(TCB* tcb, PCB* pcb)
+{
+	return tcb->gang && tcb->owner_pcb == pcb;
+}
+
+/* 
+  Return the first thread in the gang queue of victim that may run on 
+  ccb and belongs to pcb, or to any gang if pcb is NULL.
+*/
+static TCB* gang_find(CCB* victim, PCB* pcb, CCB* ccb)
+{
+	rlnode* q = &victim->gang_queue;
+	for (rlnode* n = q->next; n != q; n = n->next)
+		if ((pcb == NULL || n->tcb->owner_pcb == pcb) && (sched_mask(n->tcb) & (1u << ccb->id)))
+			return n->tcb;
+	return NULL;
+}
+
+static void gang_init(CCB* ccb)
+{
+	rlnode_init(&ccb->gang_queue, NULL);
+	ccb->gang_count = 0;
+}
+
+static void gang_enqueue(CCB* ccb, TCB* tcb)
+{
+	rlist_push_back(&ccb->gang_queue, &tcb->sched_node);
+	ccb->gang_count++;
+}
+
+static void gang_dequeue(CCB* ccb, TCB* tcb)
+{
+	rlist_remove(&tcb->sched_node);
+	ccb->gang_count--;
+}
+
+/* The first member of the open slot, if any */
+static TCB* gang_pick_next(CCB* ccb)
+{
+	PCB* pcb = sched_gang_active(sched_clock());
+	TCB* tcb = (pcb != NULL) ? gang_find(ccb, pcb, ccb) : NULL;
+	if (tcb != NULL)
+		gang_dequeue(ccb, tcb);
+	return tcb;
+}
+
+/* A member of the open slot if there is one, else any gang thread */
+static TCB* gang_steal(CCB* victim, CCB* ccb)
+{
+	PCB* pcb = sched_gang_active(sched_clock());
+	TCB* tcb = (pcb != NULL) ? gang_find(victim, pcb, ccb) : NULL;
+	if (tcb == NULL)
+		tcb = gang_find(victim, NULL, ccb);
+	if (tcb != NULL)
+		gang_dequeue(victim, tcb);
+	return tcb;
+}
+
+static const SchedClass gang_class = {
+	.name = "gang",
+	.init = gang_init,
+	.enqueue = gang_enqueue,
+	.dequeue = gang_dequeue,
+	.pick_next = gang_pick_next,
+	.steal = gang_steal,
+	.tick = NULL,
+	.on_block = NULL,
+	.migrate = NULL
+};
+
+/*
+  Open a slot for the gang at the head of the gang queue of ccb, unless 
+  a slot is open or resting. Interrupt the other cores, so that they 
+  join. Return the process of the open slot, or NULL.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static PCB* sched_gang_open(CCB* ccb, TimerDuration now)
+{
+	if (ccb->gang_count == 0 || now < __atomic_load_n(&gang_slot.rest, __ATOMIC_RELAXED))
+		return sched_gang_active(now);
+
+	McsNode node;
+	int opened = 0;
+	McsLock_Lock(&gang_lock, &node);
+	if (now >= gang_slot.rest) {
+		gang_slot.end = now + QUANTUM;
+		gang_slot.rest = gang_slot.end + QUANTUM;
+		__atomic_store_n(&gang_slot.pcb, ccb->gang_queue.next->tcb->owner_pcb, __ATOMIC_RELEASE);
+		opened = 1;
+	}
+	McsLock_Unlock(&gang_lock, &node);
+
+	if (opened)
+		for (uint c = 0; c < cpu_cores(); c++)
+			if (c != ccb->id)
+				cpu_ici(c);
+
+	return sched_gang_active(now);
+}
+
+/*
+  Return 1 if the current thread of ccb should make way for the open slot,
+  that is, if a queued member of the slot may run on ccb in its place.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static int sched_gang_preempts(CCB* ccb)
+{
+	TCB* current = ccb->current_thread;
+	PCB* pcb = sched_gang_active(sched_clock());
+	if (pcb == NULL || current == NULL || current->rt_policy != RT_NONE 
+		|| sched_gang_member(current, pcb))
+		return 0;
+
+	/* Is there a member that we may run? Peers are only try-locked, as in sched_gang_steal() */
+	if (gang_find(ccb, pcb, ccb) != NULL)
+		return 1;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* peer = &cctx[c];
+		if (c == ccb->id || peer->gang_count == 0 || !sched_trylock_core(peer))
+			continue;
+		int found = gang_find(peer, pcb, ccb) != NULL;
+		sched_unlock_core(peer);
+		if (found)
+			return 1;
+	}
+	return 0;
+}
+
+/* The classes, by sched_policy */
+static const SchedClass* const sched_classes[] = {
+	[SCHED_POLICY_MLFQ] = &mlfq_class,
+	[SCHED_POLICY_FAIR] = &fair_class
+};
+
+static sched_policy boot_policy = SCHED_POLICY_MLFQ;
+
+/* The class of the running kernel, set by initialize_scheduler() */
+static const SchedClass* sched_class = &mlfq_class;
+
+/* The class that queues tcb */
+static inline const SchedClass* sched_class_of(TCB* tcb)
+{
+	if (tcb->rt_policy != RT_NONE)
+		return &rt_class;
+	return tcb->gang ? &gang_class : sched_class;
+}
+
+void boot_sched_policy(sched_policy policy)
+{
+	assert(policy < sizeof(sched_classes)/sizeof(sched_classes[0]));
+	boot_policy = policy;
+}
+
+/*
+  Hand tcb over to core 'to'. tcb must not be queued, and we must hold 
+  the lock of its owner, or own it by a claimed wakeup.
+*/
+static inline void sched_set_core(TCB* tcb, CCB* to)
+{
+	const SchedClass* class = sched_class_of(tcb);
+	if (class->migrate != NULL && tcb->core != to->id)
+		class->migrate(&cctx[tcb->core], to, tcb);
+	tcb->core = to->id;
+}
+
+/*
+  Adaptive time-slices. The CPU burst of a thread is the time it runs 
+  before it blocks or is preempted; its average is kept with weight 1/4
+  for the newest burst. A thread gets a slice of twice its average 
+  burst, so a thread that uses up its slices sees them grow, by 25% per
+  slice, up to QUANTUM_MAX, and an interactive thread gets short slices,
+  down to QUANTUM_MIN.
+*/
+static inline void sched_update_burst(TCB* tcb, TimerDuration ran)
+{
+	/* A tickless thread may have run for long */
+	if (ran > QUANTUM_MAX)
+		ran = QUANTUM_MAX;
+	tcb->burst = (3 * tcb->burst + ran) / 4;
+}
+
+static inline TimerDuration sched_slice(TCB* tcb)
+{
+	TimerDuration slice = 2 * tcb->burst;
+	if (slice < QUANTUM_MIN)
+		return QUANTUM_MIN;
+	if (slice > QUANTUM_MAX)
+		return QUANTUM_MAX;
+	return slice;
+}
+
+/*
+  Scheduling latency. A thread is stamped when it is queued, and when it
+  is woken up, and gain() counts the time until it runs in the histograms
+  of its core.
+*/
+/* Return the bucket of a latency, see SCHEDINFO_BUCKET_LOW */
+static inline uint sched_latency_bucket(TimerDuration lat)
+{
+	if (lat < 4)
+		return lat;
+	uint msb = 63 - __builtin_clzll(lat);
+	uint bucket = ((msb - 1) << 2) | ((lat >> (msb - 2)) & 3);
+	return (bucket < SCHEDINFO_BUCKETS) ? bucket : SCHEDINFO_BUCKETS - 1;
+}
+
+/*
+  Add TCB to the ready queues of core ccb.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_queue_add(CCB* ccb, TCB* tcb)
+{
+	assert(tcb->core == ccb->id && !tcb->on_queue);
+
+	sched_class_of(tcb)->enqueue(ccb, tcb);
+	tcb->on_queue = 1;
+	ccb->ready_count++;
+
+	/* The wait counts from the first time, when tcb moves between queues */
+	if (tcb->ready_since == 0)
+		tcb->ready_since = sched_clock();
+
+	/* A real-time thread preempts the current thread, through an ICI */
+	if (tcb->rt_policy != RT_NONE && ccb->current_thread != NULL
+		&& sched_rt_before(tcb, ccb->current_thread))
+		cpu_ici(ccb->id);
+
+	/* Restart the owner if it is halted; for our own queues, wake up an idle peer 
+	   to steal, unless tcb is pinned to us */
+	if (ccb->id == cpu_core_id) {
+		if (sched_mask(tcb) != (1u << ccb->id))
+			cpu_core_restart_one();
+#ifdef SCHED_TICKLESS
+		/* The current thread now has competition */
+		if (ccb->tickless) {
+			ccb->tickless = 0;
+			bios_set_timer(QUANTUM);
+		}
+#endif
+	}
+#ifdef SCHED_TICKLESS
+	else if (ccb->tickless)
+		cpu_ici(ccb->id);
+#endif
+	else
+		cpu_core_restart(ccb->id);
+}
+
+/* Account for a thread that has left the ready queues of ccb */
+static inline TCB* sched_queue_taken(CCB* ccb, TCB* tcb)
+{
+	if (tcb != NULL) {
+		tcb->on_queue = 0;
+		ccb->ready_count--;
+		if (ccb->handoff == tcb)
+			ccb->handoff = NULL;
+	}
+	return tcb;
+}
+
+/*
+  Remove tcb from the ready queues of ccb.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static TCB* sched_queue_remove(CCB* ccb, TCB* tcb)
+{
+	sched_class_of(tcb)->dequeue(ccb, tcb);
+	return sched_queue_taken(ccb, tcb);
+}
+
+/*
+  Return 1 if tcb is in the ready queues of ccb. A thread woken up by 
+  another core is READY before it is queued.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static inline int sched_is_queued(CCB* ccb, TCB* tcb)
+{
+	return tcb->core == ccb->id && tcb->on_queue;
+}
+
+/*
+  Return 1 if ccb has a real-time thread to run now.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static inline int sched_rt_ready(CCB* ccb)
+{
+	return ccb->rt_count > 0 && !sched_rt_throttled(ccb);
+}
+
+/*
+  Remove and return the thread that ccb should run next, or NULL if its
+  queues are empty. While the real-time class is throttled, its threads 
+  wait, even if the core has nothing else to do. During a gang slot, a
+  member of the gang may be taken from a peer.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static TCB* sched_queue_pop(CCB* ccb)
+{
+	TCB* tcb = NULL;
+	if (sched_rt_ready(ccb))
+		tcb = rt_class.pick_next(ccb);
+
+	if (tcb == NULL) {
+		PCB* gang = sched_gang_open(ccb, sched_clock());
+		if (gang != NULL && (tcb = gang_class.pick_next(ccb)) == NULL
+			&& (tcb = sched_gang_steal(ccb, gang)) != NULL)
+			return tcb;	/* already taken from the peer */
+	}
+
+	if (tcb == NULL)
+		tcb = sched_class->pick_next(ccb);
+
+	/* Outside their slots, gang threads only use idle cores */
+	if (tcb == NULL && ccb->gang_count > 0) {
+		tcb = gang_find(ccb, NULL, ccb);
+		if (tcb != NULL)
+			gang_class.dequeue(ccb, tcb);
+	}
+	return sched_queue_taken(ccb, tcb);
+}
+
+/*
+  The wakeup inbox.
+
+  A core that wakes up a thread owned by another core does not take the
+  owner's lock. It claims the wakeup on tcb->state, and pushes tcb on the
+  inbox of the owner, which is a lock-free stack. The owner empties the 
+  whole stack at once, under its own lock, in yield(), gain() and the ICI
+  handler, so pops never race with each other and there is no ABA problem.
+
+  A thread is pushed once per claimed wakeup, and it cannot run (and sleep
+  again) before the owner queues it, so it is never in an inbox twice.
+*/
+static void sched_inbox_push(CCB* ccb, TCB* tcb)
+{
+	TCB* head = __atomic_load_n(&ccb->inbox, __ATOMIC_RELAXED);
+	do
+		tcb->inbox_next = head;
+	while (!__atomic_compare_exchange_n(&ccb->inbox, &head, tcb, 1,
+		__ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	/* Only the push into an empty inbox kicks the owner; gain() checks the 
+	   inbox after going tickless, so one of the two sees the other */
+	if (head == NULL) {
+#ifdef SCHED_TICKLESS
+		if (__atomic_load_n(&ccb->tickless, __ATOMIC_SEQ_CST))
+			cpu_ici(ccb->id);
+		else
+#endif
+			cpu_core_restart(ccb->id);
+	}
+}
+
+/*
+	Move tcb from STOPPED or INIT to READY, and return 1, or return 0 if
+	it was in another state. This is the only change of tcb->state that is
+	made without the lock of the owner, so every path that wakes up tcb
+	goes through here, and exactly one of them wins.
+ */
+static inline int sched_claim_wakeup(TCB* tcb)
+{
+	Thread_state state = __atomic_load_n(&tcb->state, __ATOMIC_RELAXED);
+	do {
+		if (state != STOPPED && state != INIT)
+			return 0;
+	} while (!__atomic_compare_exchange_n(&tcb->state, &state, READY, 1,
+		__ATOMIC_ACQ_REL, __ATOMIC_RELAXED));
+
+	/* Only the winner of the claim gets here; charge the sleep to its cause */
+	tcb->woken_at = sched_clock();
+	if (tcb->blocked_since != 0) {
+		tcb->stats.blocked_time[tcb->blocked_cause] += sched_clock() - tcb->blocked_since;
+		tcb->blocked_since = 0;
+	}
+	return 1;
+}
 
-//#define MMAPPED_THREAD_MEM
-#ifdef MMAPPED_THREAD_MEM
+/*
+  Queue tcb on ccb, if its affinity allows it, or else hand it to the 
+  least loaded core it may run on, through the inbox of that core.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD, where ccb owns tcb ***
+*/
+static void sched_queue_place(CCB* ccb, TCB* tcb)
+{
+	if (sched_mask(tcb) & (1u << ccb->id))
+		sched_queue_add(ccb, tcb);
+	else {
+		sched_set_core(tcb, &cctx[sched_least_loaded_core(sched_mask(tcb))]);
+		sched_inbox_push(&cctx[tcb->core], tcb);
+	}
+}
 
 /*
-  Use mmap to allocate a thread. A more detailed implementation can allocate a
-  "sentinel page", and change access to PROT_NONE, so that a stack overflow
-  is detected as seg.fault.
+	Queue a thread whose wakeup was just claimed, taking it out of the 
+	timer wheel if needed. If its phase is still CTX_DIRTY, it is the 
+	current thread of ccb on its way out, and gain() queues it.
+	*** MUST BE CALLED WITH ccb->sched_lock HELD, where ccb owns tcb ***
  */
-void free_thread(void* ptr, size_t size) { CHECK(munmap(ptr, size)); }
-
-void* allocate_thread(size_t size)
+static void sched_queue_woken(CCB* ccb, TCB* tcb)
 {
-	void* ptr = mmap(NULL, size, PROT_READ | PROT_WRITE | PROT_EXEC,
-		MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+	assert(tcb->state == READY && tcb->core == ccb->id);
 
-	CHECK((ptr == MAP_FAILED) ? -1 : 0);
+	/* Possibly remove from the timer wheel */
+	if (tcb->wakeup_time != NO_TIMEOUT) {
+		rlist_remove(&tcb->sched_node);
+		tcb->wakeup_time = NO_TIMEOUT;
+	}
 
-	return ptr;
+	if (tcb->phase == CTX_CLEAN) {
+		sched_queue_place(ccb, tcb);
+
+		/* An interactive thread does not wait behind a slice longer than QUANTUM */
+		TCB* current = ccb->current_thread;
+		if (sched_is_queued(ccb, tcb) && sched_slice(tcb) < QUANTUM
+			&& current != NULL && current->its > QUANTUM)
+			cpu_ici(ccb->id);
+	} else {
+		assert(tcb == ccb->current_thread);
+		ccb->requeue = 1;
+	}
 }
-#else
-/*
-  Use malloc to allocate a thread. This is probably faster than  mmap, but
-  cannot be made easily to 'detect' stack overflow.
- */
-void free_thread(void* ptr, size_t size) { free(ptr); }
 
-void* allocate_thread(size_t size)
+/*
+  Queue the threads in the inbox of ccb, in the order they were woken up.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_inbox_drain(CCB* ccb)
 {
-	void* ptr = aligned_alloc(SYSTEM_PAGE_SIZE, size);
-	CHECK((ptr == NULL) ? -1 : 0);
-	return ptr;
+	if (ccb->inbox == NULL)
+		return;
+
+	TCB* tcb = __atomic_exchange_n(&ccb->inbox, NULL, __ATOMIC_ACQUIRE);
+
+	/* Reverse the stack */
+	TCB* fifo = NULL;
+	while (tcb != NULL) {
+		TCB* next = tcb->inbox_next;
+		tcb->inbox_next = fifo;
+		fifo = tcb;
+		tcb = next;
+	}
+
+	while (fifo != NULL) {
+		tcb = fifo;
+		fifo = tcb->inbox_next;
+		sched_queue_woken(ccb, tcb);
+	}
 }
-#endif
 
+/*
+  Advance the timer wheel of ccb to the current time, and wake up the 
+  threads whose timeout has expired. Only the slots of the elapsed ticks
+  are visited.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static void sched_wakeup_expired_timeouts(CCB* ccb)
+{
+	TimerDuration now = bios_clock() >> TIMER_TICK_SHIFT;
+
+	/* The wheel never goes back, even if the clock does */
+	if (now < ccb->timer_tick)
+		return;
+
+	while ((ccb->timer_tick = timer_wheel_next_tick(ccb, now)) <= now) {
+		TimerDuration tick = ccb->timer_tick;
+
+		/* Entering a new slot of the upper levels: cascade them, top down */
+		if ((tick & ((1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS)) - 1)) == 0)
+			timer_wheel_cascade(ccb, &ccb->timer_overflow);
+		for (int l = TIMER_WHEEL_LEVELS - 1; l > 0; l--) {
+			if ((tick & ((1ull << (TIMER_WHEEL_BITS * l)) - 1)) == 0) {
+				uint slot = (tick >> (TIMER_WHEEL_BITS * l)) & (TIMER_WHEEL_SLOTS - 1);
+				ccb->timer_mask[l] &= ~(1ull << slot);
+				timer_wheel_cascade(ccb, &ccb->timer_wheel[l][slot]);
+			}
+		}
 
+		/* Expire the current slot of level 0 */
+		uint slot = tick & (TIMER_WHEEL_SLOTS - 1);
+		ccb->timer_mask[0] &= ~(1ull << slot);
+		rlnode* list = &ccb->timer_wheel[0][slot];
+		while (!is_rlist_empty(list)) {
+			TCB* tcb = list->next->tcb;
+			rlist_remove(&tcb->sched_node);
+			tcb->wakeup_time = NO_TIMEOUT;
+			SCHED_TRACE_EVENT(TRACE_TIMEOUT, tcb, 0, NULL, 0);
+
+			/* If another core has claimed the wakeup, our inbox queues tcb */
+			if (sched_claim_wakeup(tcb))
+				sched_queue_woken(ccb, tcb);
+		}
 
+		ccb->timer_tick = tick + 1;
+	}
+}
 
 /*
-  This is the function that is used to start normal threads.
+  Take a member of the open slot of pcb from a peer of ccb, or return NULL.
+  As in sched_queue_steal(), the peers are only try-locked.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
 */
-
-void gain(int preempt); /* forward */
-
-static void thread_start()
+static TCB* sched_gang_steal(CCB* ccb, PCB* pcb)
 {
-	gain(1);
-	cur_thread()->thread_func();
+	for (uint c = 0; c < cpu_cores(); c++) {
+		CCB* victim = &cctx[c];
+		if (c == ccb->id || victim->gang_count == 0 || !sched_trylock_core(victim))
+			continue;
+
+		TCB* tcb = gang_find(victim, pcb, ccb);
+		if (tcb != NULL) {
+			gang_dequeue(victim, tcb);
+			sched_queue_taken(victim, tcb);
+			sched_set_core(tcb, ccb);
+		}
+		sched_unlock_core(victim);
 
-	/* We are not supposed to get here! */
-	assert(0);
+		if (tcb != NULL)
+			return tcb;
+	}
+	return NULL;
 }
 
 /*
-  Initialize and return a new TCB
+  Steal a ready thread from the busiest peer of ccb, or return NULL.
+  We already hold our own lock, so we only try-lock the victim, to avoid
+  deadlocking against a peer doing the same to us.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
 */
-
-TCB* spawn_thread(PCB* pcb, void (*func)())
+static TCB* sched_queue_steal(CCB* ccb)
 {
-	/* The allocated thread size must be a multiple of page size */
-	TCB* tcb = (TCB*)allocate_thread(THREAD_SIZE);
+	CCB* victim = NULL;
+	uint most = 0;
+	for (uint c = 0; c < cpu_cores(); c++) {
+		if (c != ccb->id && cctx[c].ready_count > most) {
+			most = cctx[c].ready_count;
+			victim = &cctx[c];
+		}
+	}
 
-	/* Set the owner */
-	tcb->owner_pcb = pcb;
+	if (victim == NULL || !sched_trylock_core(victim))
+		return NULL;
 
-	/* Initialize the other attributes */
-	tcb->ptcb = NULL;
-	tcb->priority = SCHED_QUEUES/2;	//starting with the priority of the middle queue
-	tcb->type = NORMAL_THREAD;
-	tcb->state = INIT;
-	tcb->phase = CTX_CLEAN;
-	tcb->thread_func = func;
-	tcb->wakeup_time = NO_TIMEOUT;
-	rlnode_init(&tcb->sched_node, tcb); /* Intrusive list node */
+	TCB* tcb = NULL;
+	if (sched_rt_ready(victim))
+		tcb = rt_class.steal(victim, ccb);
+	if (tcb == NULL)
+		tcb = sched_class->steal(victim, ccb);
+	if (tcb == NULL && victim->gang_count > 0)
+		tcb = gang_class.steal(victim, ccb);
+	sched_queue_taken(victim, tcb);
 
-	tcb->its = QUANTUM;
-	tcb->rts = QUANTUM;
-	tcb->last_cause = SCHED_IDLE;
-	tcb->curr_cause = SCHED_IDLE;
+	/* Hand over ownership while still holding the victim's lock */
+	if (tcb != NULL)
+		sched_set_core(tcb, ccb);
 
-	/* Compute the stack segment address and size */
-	void* sp = ((void*)tcb) + THREAD_TCB_SIZE;
+	sched_unlock_core(victim);
+	return tcb;
+}
 
-	/* Init the context */
-	cpu_initialize_context(&tcb->context, sp, THREAD_STACK_SIZE, thread_start);
+/*
+  Remove the head of the scheduler queues of ccb, if any, and
+  return it. If the current thread is blocking, the thread it woke up
+  last is preferred. If our queues are empty, try to steal from a peer.
+  Return the current thread (if it is still ready, and not waiting
+  in our inbox) or the idle thread if there is no other ready thread.
+  *** MUST BE CALLED WITH ccb->sched_lock HELD ***
+*/
+static TCB* sched_queue_select(CCB* ccb, TCB* current)
+{
+	TCB* next_thread = NULL;
+
+	/* A thread that blocks hands the core to the last thread it woke up,
+	   unless a real-time thread is waiting */
+	if (!ccb->requeue && ccb->handoff != NULL
+		&& (ccb->handoff->rt_policy != RT_NONE || !sched_rt_ready(ccb))) {
+		TCB* tcb = ccb->handoff;
+		next_thread = sched_queue_remove(ccb, tcb);
+	}
 
-#ifndef NVALGRIND
-	tcb->valgrind_stack_id = VALGRIND_STACK_REGISTER(sp, sp + THREAD_STACK_SIZE);
-#endif
+	if (next_thread == NULL)
+		next_thread = sched_queue_pop(ccb);
 
-	/* increase the count of active threads */
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads++;
-	Mutex_Unlock(&active_threads_spinlock);
+	/* The current thread may have lost this core from its affinity, 
+	   or be a real-time thread of a throttled core */
+	int ready = ccb->requeue && (sched_mask(current) & (1u << ccb->id))
+		&& (current->rt_policy == RT_NONE || !sched_rt_throttled(ccb));
 
-	return tcb;
+	if (next_thread == NULL && (!ready || current->type == IDLE_THREAD))
+		next_thread = sched_queue_steal(ccb);
+
+	if (next_thread == NULL)
+		next_thread = ready ? current : &ccb->idle_thread;
+
+	next_thread->its = sched_slice(next_thread);
+
+	/* A gang thread runs until the end of the slot of its gang */
+	TimerDuration now = sched_clock();
+	PCB* gang = sched_gang_active(now);
+	if (gang != NULL && sched_gang_member(next_thread, gang) && gang_slot.end - now < next_thread->its)
+		next_thread->its = gang_slot.end - now;
+
+	/* A real-time thread runs until the window or its budget is used up */
+	if (next_thread->rt_policy != RT_NONE) {
+		TimerDuration left = RT_RUNTIME - ccb->rt_runtime;
+		if (next_thread->rt_policy == RT_EDF && next_thread->rt_left < (int64_t) left)
+			left = (next_thread->rt_left > 0) ? next_thread->rt_left : 1;
+		if (left < next_thread->its)
+			next_thread->its = left;
+	}
+
+	return next_thread;
 }
 
 /*
-  This is called with sched_spinlock locked !
- */
-void release_TCB(TCB* tcb)
+  Wake-affine placement. A thread woken up by another core is moved to 
+  the core of the waker, where the data it was waiting for is still in
+  the cache, unless the waker's core has more ready threads than the 
+  owner. Only a thread that has left its core (its phase is CTX_CLEAN)
+  and is not in the timer wheel of the owner can move without the owner's
+  lock. New threads stay where spawn_thread() placed them.
+*/
+static int sched_wake_affine(CCB* ccb, TCB* tcb, int fresh)
 {
-#ifndef NVALGRIND
-	VALGRIND_STACK_DEREGISTER(tcb->valgrind_stack_id);
-#endif
-
-	free_thread(tcb, THREAD_SIZE);
-
-	Mutex_Lock(&active_threads_spinlock);
-	active_threads--;
-	Mutex_Unlock(&active_threads_spinlock);
+	if (fresh || !(sched_mask(tcb) & (1u << ccb->id)))
+		return 0;
+	if (__atomic_load_n(&tcb->phase, __ATOMIC_ACQUIRE) != CTX_CLEAN)
+		return 0;
+	if (tcb->wakeup_time != NO_TIMEOUT)
+		return 0;
+	return ccb->ready_count <= cctx[tcb->core].ready_count;
 }
 
 /*
- *
- * Scheduler
- *
+  Make the process ready. A thread of our own core, or one that moves
+  to it, is queued at once; any other goes to the inbox of its owner.
  */
+int wakeup(TCB* tcb)
+{
+	/* Preemption off, so that the push follows the claim closely */
+	int oldpre = preempt_off;
+
+	int fresh = (tcb->state == INIT);
+	int ret = sched_claim_wakeup(tcb);
+	if (ret) {
+		SCHED_TRACE_EVENT(TRACE_WAKEUP, tcb, 0, CURCORE.current_thread, 0);
+
+		/* tcb is not queued, so its owner cannot change under us */
+		CCB* ccb = &CURCORE;
+		if (tcb->core == ccb->id || sched_wake_affine(ccb, tcb, fresh)) {
+			sched_lock_core(ccb);
+			sched_set_core(tcb, ccb);
+			sched_queue_woken(ccb, tcb);
+			/* Before the scheduler starts, there is no current thread */
+			if (ccb->current_thread != NULL && ccb->current_thread->type != IDLE_THREAD
+				&& sched_is_queued(ccb, tcb))
+				ccb->handoff = tcb;
+			sched_unlock_core(ccb);
+		} else
+			sched_inbox_push(&cctx[tcb->core], tcb);
+	}
+
+	/* Restore preemption state */
+	if (oldpre)
+		preempt_on;
+
+	return ret;
+}
 
 /*
- *  Note: the scheduler routines are all in the non-preemptive domain.
+  Priority inheritance. The owner of a contended Mutex is raised to the
+  priority of each thread that blocks on it. A queued owner moves to its 
+  new ready queue at once, otherwise the threads between the two 
+  priorities could still starve it.
+
+  The owner remembers the highest priority lent on each mutex. When it 
+  unlocks one, it drops only the priority lent on that one, so an owner
+  of nested mutexes stays raised for as long as it holds the outer ones.
  */
 
-/*
-  The scheduler queue is implemented as a doubly linked list. The
-  head and tail of this list are stored in  SCHED.
-  Also, the scheduler contains a linked list of all the sleeping
-  threads with a timeout.
-  Both of these structures are protected by @c sched_spinlock.
-*/
+/* Set the priority of tcb to its own, or the highest lent to it */
+static void pi_update(TCB* tcb)
+{
+	int priority = tcb->pi_saved;
+	for (int i = 0; i < tcb->pi_count; i++)
+		if (tcb->pi_boost[i].priority > priority)
+			priority = tcb->pi_boost[i].priority;
+	if (tcb->pi_extra > priority)
+		priority = tcb->pi_extra;
+	tcb->priority = priority;
+}
 
-rlnode SCHED[SCHED_QUEUES]; /* The scheduler queue */
-rlnode TIMEOUT_LIST; /* The list of threads with a timeout */
-Mutex sched_spinlock = MUTEX_INIT; /* spinlock for scheduler queue */
+/* Record that priority was lent to tcb on lock */
+static void pi_lend(TCB* tcb, Mutex* lock, int priority)
+{
+	int own = (tcb->pi_saved >= 0) ? tcb->pi_saved : tcb->priority;
+	if (priority <= own)
+		return;
 
-/* Interrupt handler for ALARM */
-void yield_handler() { yield(SCHED_QUANTUM); }
+	int i;
+	for (i = 0; i < tcb->pi_count; i++)
+		if (tcb->pi_boost[i].lock == lock)
+			break;
 
-/* Interrupt handle for inter-core interrupts */
-void ici_handler()
-{ /* noop for now... */
+	if (i < tcb->pi_count) {
+		if (tcb->pi_boost[i].priority < priority)
+			tcb->pi_boost[i].priority = priority;
+	} else if (tcb->pi_count < PI_BOOSTS) {
+		tcb->pi_boost[i].lock = lock;
+		tcb->pi_boost[i].priority = priority;
+		tcb->pi_count++;
+	} else if (tcb->pi_extra < priority)
+		tcb->pi_extra = priority;
+
+	tcb->pi_saved = own;
+	pi_update(tcb);
 }
 
-/*
-  Possibly add TCB to the scheduler timeout list.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_register_timeout(TCB* tcb, TimerDuration timeout)
+void sched_inherit_priority(uintptr_t owner, int priority, Mutex* lock)
 {
-	if (timeout != NO_TIMEOUT) {
-		/* set the wakeup time */
-		TimerDuration curtime = bios_clock();
-		tcb->wakeup_time = (timeout == NO_TIMEOUT) ? NO_TIMEOUT : curtime + timeout;
+	int oldpre = preempt_off;
 
-		/* add to the TIMEOUT_LIST in sorted order */
-		rlnode* n = TIMEOUT_LIST.next;
-		for (; n != &TIMEOUT_LIST; n = n->next)
-			/* skip earlier entries */
-			if (tcb->wakeup_time < n->tcb->wakeup_time)
-				break;
-		/* insert before n */
-		rl_splice(n->prev, &tcb->sched_node);
+	/* The owner cannot exit while we hold its handle bucket */
+	struct handle_bucket* b = handle_lock_bucket(owner);
+	TCB* tcb = handle_find(b, owner);
+	if (tcb == NULL) {
+		Mutex_Unlock(&b->lock);
+		if (oldpre)
+			preempt_on;
+		return;
 	}
-}
 
-/*
-  Add TCB to the end of the scheduler list.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_queue_add(TCB* tcb)
-{
-	/* Insert at the end of the scheduling list */
-	rlist_push_back(&SCHED[tcb->priority], &tcb->sched_node);
+	CCB* ccb = sched_lock_tcb(tcb);
+
+	int queued = sched_is_queued(ccb, tcb);
+	if (queued)
+		sched_queue_remove(ccb, tcb);
+
+	pi_lend(tcb, lock, priority);
 
-	/* Restart possibly halted cores */
-	cpu_core_restart_one();
+	if (queued)
+		sched_queue_add(ccb, tcb);
+
+	sched_unlock_core(ccb);
+	Mutex_Unlock(&b->lock);
+
+	if (oldpre)
+		preempt_on;
 }
 
-/*
-	Adjust the state of a thread to make it READY.
-	*** MUST BE CALLED WITH sched_spinlock HELD ***
- */
-static void sched_make_ready(TCB* tcb)
+void sched_restore_priority(TCB* tcb, Mutex* lock)
 {
-	assert(tcb->state == STOPPED || tcb->state == INIT);
+	int oldpre = preempt_off;
+	CCB* ccb = sched_lock_tcb(tcb);
 
-	/* Possibly remove from TIMEOUT_LIST */
-	if (tcb->wakeup_time != NO_TIMEOUT) {
-		/* tcb is in TIMEOUT_LIST, fix it */
-		assert(tcb->sched_node.next != &(tcb->sched_node) && tcb->state == STOPPED);
-		rlist_remove(&tcb->sched_node);
-		tcb->wakeup_time = NO_TIMEOUT;
+	for (int i = 0; i < tcb->pi_count; i++)
+		if (tcb->pi_boost[i].lock == lock) {
+			tcb->pi_boost[i] = tcb->pi_boost[--tcb->pi_count];
+			break;
+		}
+
+	if (tcb->pi_saved >= 0) {
+		/* The priorities lent beyond PI_BOOSTS go with the last tracked one */
+		if (tcb->pi_count == 0)
+			tcb->pi_extra = -1;
+		pi_update(tcb);
+		if (tcb->pi_count == 0)
+			tcb->pi_saved = -1;
 	}
 
-	/* Mark as ready */
-	tcb->state = READY;
+	sched_unlock_core(ccb);
 
-	/* Possibly add to the scheduler queue */
-	if (tcb->phase == CTX_CLEAN)
-		sched_queue_add(tcb);
+	if (oldpre)
+		preempt_on;
 }
 
-/*
-  Scan the \c TIMEOUT_LIST for threads whose timeout has expired, and
-  wake them up.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static void sched_wakeup_expired_timeouts()
+int sched_set_affinity(TCB* tcb, coremask_t mask)
 {
-	/* Empty the timeout list up to the current time and wake up each thread */
-	TimerDuration curtime = bios_clock();
+	int oldpre = preempt_off;
+	CCB* ccb = sched_lock_tcb(tcb);
 
-	while (!is_rlist_empty(&TIMEOUT_LIST)) {
-		TCB* tcb = TIMEOUT_LIST.next->tcb;
-		if (tcb->wakeup_time > curtime)
-			break;
-		sched_make_ready(tcb);
+	tcb->affinity = mask;
+	int allowed = (sched_mask(tcb) & (1u << ccb->id)) != 0;
+
+	/* Threads in other states move when they are queued again */
+	if (!allowed && sched_is_queued(ccb, tcb)) {
+		sched_queue_remove(ccb, tcb);
+		sched_queue_place(ccb, tcb);
 	}
+
+	sched_unlock_core(ccb);
+
+	if (oldpre)
+		preempt_on;
+	return !allowed;
 }
 
-/*
-  Remove the head of the scheduler list, if any, and
-  return it. Return NULL if the list is empty.
-  *** MUST BE CALLED WITH sched_spinlock HELD ***
-*/
-static TCB* sched_queue_select(TCB* current)
+void sched_latency_read(uint core, schedinfo* info)
 {
-	int head = SCHED_QUEUES - 1;
+	int oldpre = preempt_off;
+	CCB* ccb = &cctx[core];
+	sched_lock_core(ccb);
 
-	for(int i = SCHED_QUEUES - 1; i>=0; i--){
-		if(!is_rlist_empty(&SCHED[i])){
-			head = i;
-			break;
-		}
+	info->core = core;
+	for (int b = 0; b < SCHEDINFO_BUCKETS; b++) {
+		info->runq_wait[b] = ccb->lat_runq[b];
+		info->wake_to_run[b] = ccb->lat_wake[b];
 	}
 
+	sched_unlock_core(ccb);
+
+	if (oldpre)
+		preempt_on;
+}
+
+void sched_set_gang(TCB* tcb, int gang)
+{
+	int oldpre = preempt_off;
+	CCB* ccb = sched_lock_tcb(tcb);
 
-	/* Get the head of the SCHED list */
-	rlnode* sel = rlist_pop_front(&SCHED[head]);
+	/* A queued thread moves to the queue of its new class */
+	int queued = sched_is_queued(ccb, tcb);
+	if (queued)
+		sched_queue_remove(ccb, tcb);
+	tcb->gang = gang;
+	if (queued)
+		sched_queue_place(ccb, tcb);
 
-	TCB* next_thread = sel->tcb; /* When the list is empty, this is NULL */
+	sched_unlock_core(ccb);
 
-	if (next_thread == NULL)
-		next_thread = (current->state == READY) ? current : &CURCORE.idle_thread;
+	if (oldpre)
+		preempt_on;
+}
 
-	next_thread->its = QUANTUM;
+void sched_gang_release(PCB* pcb)
+{
+	int oldpre = preempt_off;
 
-	return next_thread;
+	/* The slot only compares the pointer; clearing it is enough */
+	McsNode node;
+	McsLock_Lock(&gang_lock, &node);
+	if (gang_slot.pcb == pcb)
+		__atomic_store_n(&gang_slot.pcb, NULL, __ATOMIC_RELEASE);
+	McsLock_Unlock(&gang_lock, &node);
+
+	if (oldpre)
+		preempt_on;
 }
 
-/*
-  Make the process ready.
- */
-int wakeup(TCB* tcb)
+void sched_stats_add(sched_stats* sum, const sched_stats* stats)
 {
-	int ret = 0;
+	sum->run_time += stats->run_time;
+	sum->vol_switches += stats->vol_switches;
+	sum->invol_switches += stats->invol_switches;
+	for (int c = 0; c < SCHED_CAUSES; c++)
+		sum->blocked_time[c] += stats->blocked_time[c];
+}
 
-	/* Preemption off */
+void sched_stats_exit(sched_stats* sum)
+{
+	/* Nobody else writes our stats or slice_start while we run */
 	int oldpre = preempt_off;
+	CCB* ccb = &CURCORE;
+
+	sched_stats* stats = &ccb->current_thread->stats;
+	TimerDuration ran = sched_clock() - ccb->slice_start;
+	sched_stats_add(sum, stats);
+	sum->run_time += ran;
+
+	/* 
+	   Start over. yield() adds the whole slice to run_time, so the part
+	   moved to sum is taken out in advance (run_time is unsigned, so 
+	   this wraps around, and the addition brings it back).
+	 */
+	*stats = (sched_stats) { .run_time = -ran };
+
+	if (oldpre)
+		preempt_on;
+}
+
+int sched_set_realtime(TCB* tcb, const rt_params* params)
+{
+	TimerDuration period = (TimerDuration) params->period * 1000;
+	TimerDuration budget = (TimerDuration) params->budget * 1000;
+	int core = 0;
 
-	/* To touch tcb->state, we must get the spinlock. */
-	Mutex_Lock(&sched_spinlock);
+	int oldpre = preempt_off;
 
-	if (tcb->state == STOPPED || tcb->state == INIT) {
-		sched_make_ready(tcb);
-		ret = 1;
+	/* The lock of tcb also orders us with its exit, which releases its admission */
+	CCB* ccb = sched_lock_tcb(tcb);
+
+	/* Admission control, against the utilization of the other RT_EDF threads */
+	sched_rt_release(tcb);
+	if (params->policy == RT_EDF) {
+		core = sched_rt_admit(tcb->affinity, sched_rt_util(budget, period));
+		if (core < 0) {
+			/* Keep the old admission */
+			if (tcb->rt_policy == RT_EDF)
+				__atomic_add_fetch(&cctx[tcb->rt_core].rt_util, 
+					sched_rt_util(tcb->rt_budget, tcb->rt_period), __ATOMIC_RELAXED);
+			sched_unlock_core(ccb);
+			if (oldpre)
+				preempt_on;
+			return -1;
+		}
 	}
 
-	Mutex_Unlock(&sched_spinlock);
+	/* A queued thread is queued again, by its new class */
+	int queued = sched_is_queued(ccb, tcb);
+	if (queued)
+		sched_queue_remove(ccb, tcb);
+
+	tcb->rt_policy = params->policy;
+	tcb->rt_priority = params->priority;
+	tcb->rt_core = core;
+	tcb->rt_period = period;
+	tcb->rt_budget = budget;
+	tcb->rt_deadline = sched_clock() + period;
+	tcb->rt_left = budget;
+
+	if (queued)
+		sched_queue_place(ccb, tcb);
+
+	sched_unlock_core(ccb);
 
-	/* Restore preemption state */
 	if (oldpre)
 		preempt_on;
-
-	return ret;
+	return 0;
 }
 
 /*
@@ -377,22 +2279,39 @@ void sleep_releasing(Thread_state state, Mutex* mx, enum SCHED_CAUSE cause,
 
 
 	int preempt = preempt_off;
-	TCB* tcb = CURTHREAD;
-	Mutex_Lock(&sched_spinlock);
+	CCB* ccb = &CURCORE;
+	TCB* tcb = ccb->current_thread;
+
+	/* From now on, waiters on the mutexes we still hold cannot find us */
+	if (state == EXITED)
+		handle_unregister(tcb);
 
-	/* mark the thread as stopped or exited */
-	tcb->state = state;
+	sched_lock_core(ccb);
+
+	SCHED_TRACE_EVENT(TRACE_SLEEP, tcb, state, NULL, timeout);
+
+	/* Published to the waker by the store of the state */
+	tcb->blocked_since = sched_clock();
+	tcb->blocked_cause = cause;
 
 	/* register the timeout (if any) for the sleeping thread */
 	if (state != EXITED)
-		sched_register_timeout(tcb, timeout);
+		sched_register_timeout(ccb, tcb, timeout);
 
-	/* Release mx */
-	if (mx != NULL)
-		Mutex_Unlock(mx);
+	/* mark the thread as stopped or exited; from now on, it can be woken up */
+	__atomic_store_n(&tcb->state, state, __ATOMIC_RELEASE);
 
 	/* Release the schduler spinlock before calling yield() !!! */
-	Mutex_Unlock(&sched_spinlock);
+	sched_unlock_core(ccb);
+
+	/* 
+	   Release mx. This is done after the scheduler lock, because unlocking
+	   may wake up a thread blocked on mx. A wakeup of this thread before it 
+	   is switched out is harmless: its phase is CTX_DIRTY, so it is queued
+	   by gain(), or by the inbox drain that follows it.
+	*/
+	if (mx != NULL)
+		Mutex_Unlock(mx);
 
 	/* call this to schedule someone else */
 	yield(cause);
@@ -412,67 +2331,75 @@ void yield(enum SCHED_CAUSE cause)
 	/* We must stop preemption but save it! */
 	int preempt = preempt_off;
 
-	TCB* current = CURTHREAD; /* Make a local copy of current process, for speed */
-
-	yield_counter++;	// Add 1 to counter for the MLFQ
-
+	CCB* ccb = &CURCORE;
+	TCB* current = ccb->current_thread; /* Make a local copy of current process, for speed */
 
-	Mutex_Lock(&sched_spinlock);
+	sched_lock_core(ccb);
 
 	/* Update CURTHREAD state */
-	if (current->state == RUNNING)
+	int blocking = (current->state != RUNNING);
+	if (current->state == RUNNING) {
 		current->state = READY;
+		ccb->requeue = 1;
+	}
 
 	/* Update CURTHREAD scheduler data */
 	current->rts = remaining;
 	current->last_cause = current->curr_cause;
 	current->curr_cause = cause;
+	SCHED_TRACE_EVENT(TRACE_YIELD, current, cause, NULL, 0);
 
 	/* Wake up threads whose sleep timeout has expired */
-	sched_wakeup_expired_timeouts();
-
-	if(yield_counter > 2000){
-		boost();	//boosting the thread's priority by 1, to avoid starvation
-		yield_counter = 0;	//since we fixed the problem we set yield_counter back to 0
-	}
-
-	if(current->priority != 0){
-		switch(cause){
-
-		case SCHED_QUANTUM:
-			current->priority--;
-
-		case SCHED_IO:
-			if(current->priority == SCHED_QUEUES){
-				current->priority = SCHED_QUEUES;
-			}else{
-				current->priority++;
-			}
-
-		case SCHED_MUTEX:
-			current->priority--;
-
+	sched_wakeup_expired_timeouts(ccb);
+
+	/* Queue the threads woken up by other cores */
+	sched_inbox_drain(ccb);
+
+	/* Let the scheduler class account for the time slice */
+	const SchedClass* class = sched_class_of(current);
+	TimerDuration ran = sched_clock() - ccb->slice_start;
+	current->stats.run_time += ran;
+	sched_update_burst(current, ran);
+	if (class->tick != NULL)
+		class->tick(ccb, current, cause, ran);
+	if (blocking && current->state != EXITED && current->type != IDLE_THREAD 
+		&& class->on_block != NULL)
+		class->on_block(ccb, current, cause);
+
+	if (current->rt_policy != RT_NONE) {
+		sched_rt_throttled(ccb);
+		ccb->rt_runtime += ran;
+
+		/* An RT_EDF thread out of budget sleeps until its deadline */
+		TimerDuration now = sched_clock();
+		if (current->rt_policy == RT_EDF && ccb->requeue && current->rt_left <= 0
+			&& current->rt_deadline > now) {
+			ccb->requeue = 0;
+			sched_register_timeout(ccb, current, current->rt_deadline - now);
+			__atomic_store_n(&current->state, STOPPED, __ATOMIC_RELEASE);
 		}
 	}
 
-
 	/* Get next */
-	TCB* next = sched_queue_select(current);
+	TCB* next = sched_queue_select(ccb, current);
 	assert(next != NULL);
 
 	/* Save the current TCB for the gain phase */
-	CURCORE.previous_thread = current;
+	ccb->previous_thread = current;
 
-	Mutex_Unlock(&sched_spinlock);
+	sched_unlock_core(ccb);
 
 	/* Switch contexts */
 	if (current != next) {
-		CURTHREAD = next;
+		ccb->switches++;
+		ccb->current_thread = next;
+		ccb->current_handle = next->handle;
 		cpu_swap_context(&current->context, &next->context);
 	}
 
 	/* This is where we get after we are switched back on! A long time
-	   may have passed. Start a new timeslice...
+	   may have passed, and we may be running on a different core. 
+	   Start a new timeslice...
 	  */
 	gain(preempt);
 }
@@ -490,25 +2417,46 @@ void yield(enum SCHED_CAUSE cause)
 
 void gain(int preempt)
 {
-	Mutex_Lock(&sched_spinlock);
+	CCB* ccb = &CURCORE;
+	sched_lock_core(ccb);
 
-	TCB* current = CURTHREAD;
+	TCB* current = ccb->current_thread;
 
 	/* Mark current state */
 	current->state = RUNNING;
 	current->phase = CTX_DIRTY;
 	current->rts = current->its;
+	ccb->slice_start = sched_clock();
+
+	/* Count the latency of the current thread, if it was queued or woken up */
+	if (current->ready_since != 0 || current->woken_at != 0) {
+		TimerDuration now = ccb->slice_start;
+		if (current->ready_since != 0)
+			ccb->lat_runq[sched_latency_bucket(now - current->ready_since)]++;
+		if (current->woken_at != 0)
+			ccb->lat_wake[sched_latency_bucket(now - current->woken_at)]++;
+		current->ready_since = current->woken_at = 0;
+	}
 
 	/* Take care of the previous thread */
-	TCB* prev = CURCORE.previous_thread;
+	TCB* prev = ccb->previous_thread;
 	if (current != prev) {
-		prev->phase = CTX_CLEAN;
+		SCHED_TRACE_EVENT(TRACE_SWITCH, current, prev->state, prev, 0);
+		/* Publish the saved context, for a wake-affine move of prev */
+		__atomic_store_n(&prev->phase, CTX_CLEAN, __ATOMIC_RELEASE);
+		ccb->handoff = NULL;
+		if (prev->state == READY)
+			prev->stats.invol_switches++;
+		else
+			prev->stats.vol_switches++;
 		switch (prev->state) {
 		case READY:
-			if (prev->type != IDLE_THREAD)
-				sched_queue_add(prev);
+			/* Unless another core woke it up, and left it in our inbox */
+			if (ccb->requeue && prev->type != IDLE_THREAD)
+				sched_queue_place(ccb, prev);
 			break;
 		case EXITED:
+			sched_rt_release(prev);
 			release_TCB(prev);
 			break;
 		case STOPPED:
@@ -517,15 +2465,63 @@ void gain(int preempt)
 			assert(0); /* prev->state should not be INIT or RUNNING ! */
 		}
 	}
+	ccb->requeue = 0;
+
+	sched_inbox_drain(ccb);
+
+	/* Set a 1-quantum alarm, unless nobody else wants the core */
+	TimerDuration alarm = current->rts;
+#ifdef SCHED_TICKLESS
+	/* A real-time thread is always ticked, to charge its runtime */
+	ccb->tickless = (current->type == IDLE_THREAD || ccb->ready_count == 0)
+		&& current->rt_policy == RT_NONE;
+	if (ccb->tickless) {
+		/* A push that saw us ticking did not kick us; drain it now */
+		__atomic_thread_fence(__ATOMIC_SEQ_CST);
+		sched_inbox_drain(ccb);
+		ccb->tickless = (current->type == IDLE_THREAD || ccb->ready_count == 0);
+	}
+	if (ccb->tickless) {
+		/* Wake up for the next timeout. Give the coarse clock a tick of slack. */
+		TimerDuration deadline = timer_wheel_deadline(ccb);
+		if (deadline == NO_TIMEOUT)
+			alarm = 0;
+		else {
+			TimerDuration curtime = bios_clock();
+			deadline <<= TIMER_TICK_SHIFT;
+			alarm = (deadline > curtime) ? deadline - curtime : 0;
+			alarm += (1ul << TIMER_TICK_SHIFT);
+		}
+	}
+	else if (alarm > QUANTUM) {
+		/* A long slice holds back the timeouts due in it by QUANTUM at most */
+		TimerDuration deadline = timer_wheel_deadline(ccb);
+		if (deadline != NO_TIMEOUT) {
+			TimerDuration curtime = bios_clock();
+			deadline <<= TIMER_TICK_SHIFT;
+			TimerDuration until = (deadline > curtime) ? deadline - curtime : 0;
+			if (until < alarm)
+				alarm = (until > QUANTUM) ? until : QUANTUM;
+		}
+	}
+#endif
+
+	/* Wake up when the throttled real-time threads may run again */
+	if (ccb->rt_count > 0 && sched_rt_throttled(ccb)) {
+		TimerDuration now = sched_clock();
+		TimerDuration end = (ccb->rt_window + RT_PERIOD > now) ? ccb->rt_window + RT_PERIOD - now : 1;
+		if (alarm == 0 || end < alarm)
+			alarm = end;
+	}
+
+	sched_unlock_core(ccb);
 
-	Mutex_Unlock(&sched_spinlock);
+	/* Arm the timer before interrupts are enabled, so that a pending ICI is not overridden */
+	bios_set_timer(alarm);
 
 	/* Reset preemption as needed */
 	if (preempt)
 		preempt_on;
-
-	/* Set a 1-quantum alarm */
-	bios_set_timer(current->rts);
 }
 
 static void idle_thread()
@@ -535,7 +2531,9 @@ static void idle_thread()
 
 	/* We come here whenever we cannot find a ready thread for our core */
 	while (active_threads > 0) {
-		cpu_core_halt();
+		/* gain() may have queued threads from the inbox behind us */
+		if (CURCORE.ready_count == 0)
+			cpu_core_halt();
 		yield(SCHED_IDLE);
 	}
 
@@ -545,18 +2543,34 @@ static void idle_thread()
 }
 
 /*
-  Initialize the scheduler queue
+  Initialize the scheduler queues of all cores
  */
 void initialize_scheduler()
 {
-
-	for(int i = 0; i <= SCHED_QUEUES - 1; i++){
-		rlnode_init(&SCHED[i], NULL);
+	sched_class = sched_classes[boot_policy];
+	for (uint c = 0; c < MAX_CORES; c++) {
+		CCB* ccb = &cctx[c];
+		ccb->id = c;
+		ccb->sched_lock = MCS_LOCK_INIT;
+		sched_class->init(ccb);
+		rt_class.init(ccb);
+		gang_class.init(ccb);
+		ccb->ready_count = 0;
+		for (int l = 0; l < TIMER_WHEEL_LEVELS; l++) {
+			for (int i = 0; i < TIMER_WHEEL_SLOTS; i++)
+				rlnode_init(&ccb->timer_wheel[l][i], NULL);
+			ccb->timer_mask[l] = 0;
+		}
+		rlnode_init(&ccb->timer_overflow, NULL);
+		ccb->timer_tick = bios_clock() >> TIMER_TICK_SHIFT;
+		ccb->tickless = 0;
+		ccb->inbox = NULL;
+		ccb->requeue = 0;
+		ccb->handoff = NULL;
+		ccb->thread_cache = NULL;
+		ccb->thread_cache_count = 0;
+		ccb->slice_start = sched_clock();
 	}
-
-	rlnode_init(&TIMEOUT_LIST, NULL);
-
-	yield_counter = 0;
 }
 
 void run_scheduler()
@@ -567,16 +2581,27 @@ void run_scheduler()
 	curcore->id = cpu_core_id;
 
 	curcore->current_thread = &curcore->idle_thread;
+	curcore->current_handle = curcore->idle_thread.handle = handle_new();
 
 	curcore->idle_thread.owner_pcb = get_pcb(0);
 	curcore->idle_thread.type = IDLE_THREAD;
 	curcore->idle_thread.state = RUNNING;
 	curcore->idle_thread.phase = CTX_DIRTY;
 	curcore->idle_thread.wakeup_time = NO_TIMEOUT;
+	curcore->idle_thread.core = cpu_core_id;
+	curcore->idle_thread.affinity = 1u << cpu_core_id;
+	curcore->idle_thread.on_queue = 0;
+	curcore->idle_thread.vruntime = 0;
+	curcore->idle_thread.rt_policy = RT_NONE;
+	curcore->idle_thread.gang = 0;
 	rlnode_init(&curcore->idle_thread.sched_node, &curcore->idle_thread);
 
 	curcore->idle_thread.priority = 0;	// idle threads priorit is set to 0
+	curcore->idle_thread.pi_saved = -1;
+	curcore->idle_thread.pi_count = 0;
+	curcore->idle_thread.pi_extra = -1;
 
+	curcore->idle_thread.burst = QUANTUM/2;
 	curcore->idle_thread.its = QUANTUM;
 	curcore->idle_thread.rts = QUANTUM;
 
@@ -595,14 +2620,112 @@ void run_scheduler()
 	assert(CURTHREAD == &CURCORE.idle_thread);
 	cpu_interrupt_handler(ALARM, NULL);
 	cpu_interrupt_handler(ICI, NULL);
+
+	/* Return the cached thread blocks */
+	thread_cache_drain();
+
+#ifdef LOCK_PROFILING
+	if (cpu_core_id == 0)
+		lock_profile_dump();
+#endif
+#ifdef SCHED_TRACE
+	if (cpu_core_id == 0)
+		sched_trace_dump();
+#endif
+}
+
+
+#ifdef SCHED_TRACE
+
+static const char* trace_cause[] = {
+	"quantum", "io", "mutex", "pipe", "poll", "idle", "user"
+};
+
+static const char* trace_state[] = {
+	"init", "ready", "running", "stopped", "exited"
+};
+
+/* Print the name of a thread, as a JSON string */
+static void trace_thread_name(FILE* f, TCB* tcb, Pid_t pid)
+{
+	if (pid == NOPROC)
+		fprintf(f, "\"idle\"");
+	else
+		fprintf(f, "\"pid %d thread %p\"", pid, (void*) tcb);
 }
 
-void boost(){
-	for(int i = SCHED_QUEUES-1; i>=0; i--){
-		while(!is_rlist_empty(&SCHED[i])){
-			rlnode* curnode = rlist_pop_front(&SCHED[i]);
-			curnode->tcb->priority++;
-			rlist_push_front(&SCHED[i+1], curnode);
+void sched_trace_dump()
+{
+	FILE* f = fopen(SCHED_TRACE_FILE, "w");
+	if (f == NULL) {
+		perror("sched_trace_dump: " SCHED_TRACE_FILE);
+		return;
+	}
+
+	/* All events go in the tracks of process 0, one track per core */
+	fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+	fprintf(f, "{\"ph\": \"M\", \"pid\": 0, \"name\": \"process_name\", \"args\": {\"name\": \"cores\"}}");
+
+	for (uint c = 0; c < cpu_cores(); c++) {
+		struct sched_trace* trace = &sched_traces[c];
+		unsigned long head = __atomic_load_n(&trace->head, __ATOMIC_ACQUIRE);
+		unsigned long first = (head > SCHED_TRACE_EVENTS) ? head - SCHED_TRACE_EVENTS : 0;
+
+		fprintf(f, ",\n{\"ph\": \"M\", \"pid\": 0, \"tid\": %u, \"name\": \"thread_name\", "
+			"\"args\": {\"name\": \"core %u\"}}", c, c);
+
+		/* The slice of the running thread lasts until the next switch */
+		sched_event* running = NULL;
+		TimerDuration last = 0;
+
+		for (unsigned long i = first; i < head; i++) {
+			sched_event* ev = &trace->event[i & (SCHED_TRACE_EVENTS - 1)];
+			last = ev->time;
+
+			if (ev->type == TRACE_SWITCH) {
+				if (running != NULL) {
+					fprintf(f, ",\n{\"ph\": \"X\", \"pid\": 0, \"tid\": %u, \"ts\": %lu, \"dur\": %lu, \"name\": ",
+						c, (unsigned long) running->time, (unsigned long)(ev->time - running->time));
+					trace_thread_name(f, running->tcb, running->pid);
+					fprintf(f, "}");
+				}
+				running = ev;
+				continue;
+			}
+
+			fprintf(f, ",\n{\"ph\": \"i\", \"s\": \"t\", \"pid\": 0, \"tid\": %u, \"ts\": %lu, ",
+				c, (unsigned long) ev->time);
+			switch (ev->type) {
+			case TRACE_YIELD:
+				fprintf(f, "\"name\": \"yield\", \"args\": {\"cause\": \"%s\"}}", trace_cause[ev->arg]);
+				break;
+			case TRACE_WAKEUP:
+				fprintf(f, "\"name\": \"wakeup\", \"args\": {\"thread\": ");
+				trace_thread_name(f, ev->tcb, ev->pid);
+				fprintf(f, "}}");
+				break;
+			case TRACE_SLEEP:
+				fprintf(f, "\"name\": \"sleep\", \"args\": {\"state\": \"%s\", \"timeout\": %ld}}",
+					trace_state[ev->arg], (ev->timeout == NO_TIMEOUT) ? -1l : (long) ev->timeout);
+				break;
+			case TRACE_TIMEOUT:
+				fprintf(f, "\"name\": \"timeout\", \"args\": {\"thread\": ");
+				trace_thread_name(f, ev->tcb, ev->pid);
+				fprintf(f, "}}");
+				break;
+			}
+		}
+
+		if (running != NULL) {
+			fprintf(f, ",\n{\"ph\": \"X\", \"pid\": 0, \"tid\": %u, \"ts\": %lu, \"dur\": %lu, \"name\": ",
+				c, (unsigned long) running->time, (unsigned long)(last - running->time));
+			trace_thread_name(f, running->tcb, running->pid);
+			fprintf(f, "}");
 		}
 	}
-}
\ No newline at end of file
+
+	fprintf(f, "\n]}\n");
+	fclose(f);
+}
+
+#endif
@@ -0,0 +1,672 @@
+/*
+ *  Scheduler API and implementation 
+ *
+ */
+
+#ifndef __KERNEL_SCHED_H
+#define __KERNEL_SCHED_H
+
+/**
+  @file kernel_sched.h
+  @brief TinyOS kernel: The Scheduler API
+  @defgroup scheduler Scheduler
+  @ingroup kernel
+  @brief The Scheduler API
+  This file contains the definition of the scheduler API, exported to other modules
+  of the kernel.
+  @{
+*/
+
+#include "bios.h"
+#include "tinyos.h"
+#include "util.h"
+
+/*****************************
+ *
+ *  The Thread Control Block
+ *
+ *****************************/
+
+/** @brief Thread state. 
+  A value of this type, together with a @c Thread_phase value, completely
+  determines the state of a thread. 
+  @see Thread_phase
+*/
+typedef enum {
+  INIT, /**< @brief TCB initialising */
+  READY, /**< @brief A thread ready to be scheduled.   */
+  RUNNING, /**< @brief A thread running on some core   */
+  STOPPED, /**< @brief A blocked thread   */
+  EXITED /**< @brief A terminated thread   */
+} Thread_state;
+
+/** @brief Thread phase. 
+  The phase of a thread denotes the state of its context stored in the @c TCB of the
+  thread. 
+  A @c CTX_CLEAN thread means that, the context stored in the TCB is up-to-date. 
+  In this case, it is legal to swap context to this thread.
+  A @c CTX_DIRTY thread marks the case when the thread was, or still is, being executed 
+  at some core, therefore its stored context should not be used.
+  The following **invariant** of the scheduler guarantees 
+  correctness:  
+  > A TCB is in the scheduler
+  > queue, if and only if, its @c Thread_state is @c READY and the @c Thread_phase 
+  > is @c CTX_CLEAN.
+  @see Thread_state
+*/
+typedef enum {
+  CTX_CLEAN, /**< @brief Context is clean. */
+
+  CTX_DIRTY /**< @brief Context is dirty. */
+} Thread_phase;
+
+/** @brief Thread type. */
+typedef enum {
+  IDLE_THREAD, /**< @brief Marks an idle thread. */
+  NORMAL_THREAD /**< @brief Marks a normal thread */
+} Thread_type;
+
+/**
+  @brief Designate different origins of scheduler invocation.
+  This is used in the scheduler heuristics to determine how to
+  adjust the dynamic priority of the current thread.
+ */
+enum SCHED_CAUSE {
+  SCHED_QUANTUM, /**< @brief The quantum has expired */
+  SCHED_IO, /**< @brief The thread is waiting for I/O */
+  SCHED_MUTEX, /**< @brief @c Mutex_Lock yielded on contention */
+  SCHED_PIPE, /**< @brief Sleep at a pipe or socket */
+  SCHED_POLL, /**< @brief The thread is polling a device */
+  SCHED_IDLE, /**< @brief The idle thread called yield */
+  SCHED_USER /**< @brief User-space code called yield */
+};
+
+/** @brief The number of values of @c enum SCHED_CAUSE */
+#define SCHED_CAUSES (SCHED_USER+1)
+
+/**
+  @brief CPU accounting of a thread, or of a number of threads.
+  @see procinfo
+ */
+typedef struct sched_stats {
+  TimerDuration run_time; /**< @brief Time spent running, in usec */
+  unsigned long vol_switches; /**< @brief Switches away from the thread when it blocked or exited */
+  unsigned long invol_switches; /**< @brief Switches away from the thread while it was still ready */
+  TimerDuration blocked_time[SCHED_CAUSES]; /**< @brief Time spent blocked, in usec, by the cause 
+                                                 given to @c sleep_releasing() */
+} sched_stats;
+
+
+/**
+  @brief The process thread control block 
+  
+  An object of this type is has an 1:1 relation with the thread control
+  block. For every process control block there exist N PTCBs, 1:N relation.  
+*/
+typedef struct process_thread_control_block {
+
+
+  TCB* tcb;
+
+  Task task;
+  int argl;
+  void* args;
+
+  int exitval;
+  
+  int exited;
+  int detached;
+
+  CondVar exit_cv;
+
+  int refcount;
+
+  rlnode ptcb_list_node;
+
+}PTCB;
+
+
+
+/** @brief Number of contended mutexes whose lent priorities a thread tracks one by one.
+  Priorities lent on further mutexes are given back with the last of these.
+  @see sched_inherit_priority
+ */
+#define PI_BOOSTS 8
+
+/**
+  @brief The thread control block
+  An object of this type is associated to every thread. In this object
+  are stored all the metadata that relate to the thread.
+*/
+typedef struct thread_control_block {
+
+  PCB* owner_pcb; /**< @brief This is null for a free TCB */
+
+  PTCB* ptcb;
+
+  uintptr_t handle; /**< @brief Names the thread in the word of a @c Mutex it owns. Handles are
+                         never reused, see @c sched_inherit_priority() */
+  rlnode handle_node; /**< @brief Node in the table of live thread handles */
+
+  int priority;
+  int pi_saved; /**< @brief The priority before inheriting a higher one from the waiters 
+                     of a @c Mutex this thread holds, or -1 if it has not inherited one */
+  struct {
+    Mutex* lock;
+    int priority;
+  } pi_boost[PI_BOOSTS]; /**< @brief The highest priority lent by the waiters of each 
+                              contended @c Mutex this thread holds */
+  int pi_count; /**< @brief Number of entries in @c pi_boost */
+  int pi_extra; /**< @brief A priority lent when @c pi_boost was full, or -1 */
+
+  cpu_context_t context; /**< @brief The thread context */
+  Thread_type type; /**< @brief The type of thread */
+  Thread_state state; /**< @brief The state of the thread */
+  Thread_phase phase; /**< @brief The phase of the thread */
+
+  void (*thread_func)(); /**< @brief The initial function executed by this thread */
+  size_t stack_size; /**< @brief Size of the stack, which lies right below the TCB */
+
+  TimerDuration wakeup_time; /**< @brief The time this thread will be woken up by the scheduler */
+
+  uint core; /**< @brief The core whose run queues own this thread */
+  coremask_t affinity; /**< @brief The cores this thread may be queued on, see @c SetAffinity() */
+
+  int gang; /**< @brief Set if the process of the thread is gang-scheduled, see @c SetGang() */
+
+  rt_policy rt_policy; /**< @brief The real-time policy, see @c SetRealtime() */
+  int rt_priority; /**< @brief Priority of an @c RT_FIFO thread */
+  uint rt_core; /**< @brief The core that admitted an @c RT_EDF thread */
+  TimerDuration rt_period; /**< @brief Period of an @c RT_EDF thread */
+  TimerDuration rt_budget; /**< @brief Budget per period of an @c RT_EDF thread */
+  TimerDuration rt_deadline; /**< @brief Absolute deadline of the current period */
+  int64_t rt_left; /**< @brief Budget left in the current period */
+  struct thread_control_block* inbox_next; /**< @brief Link in the wakeup inbox of @c core, see @c CCB::inbox */
+
+  rlnode sched_node; /**< @brief Node to use when queueing in the scheduler queue */
+  int on_queue; /**< @brief Set while the thread is in the ready queues of its core */
+  TimerDuration vruntime; /**< @brief Weighted CPU time, for the fair class */
+  struct thread_control_block* fair_child; /**< @brief First child in the fair class heap */
+  struct thread_control_block* fair_sibling; /**< @brief Next sibling in the fair class heap */
+  struct thread_control_block* fair_prev; /**< @brief Previous sibling, or parent of a first child, 
+                                                in the fair class heap */
+  TimerDuration burst; /**< @brief Moving average of the CPU bursts of this thread */
+  TimerDuration its; /**< @brief Initial time-slice for this thread */
+  TimerDuration rts; /**< @brief Remaining time-slice for this thread */
+
+  enum SCHED_CAUSE curr_cause; /**< @brief The endcause for the current time-slice */
+  enum SCHED_CAUSE last_cause; /**< @brief The endcause for the last time-slice */
+
+  TimerDuration ready_since; /**< @brief When the thread was queued, or 0, see @c CCB::lat_runq */
+  TimerDuration woken_at; /**< @brief When the thread was woken up, or 0, see @c CCB::lat_wake */
+
+  sched_stats stats; /**< @brief CPU accounting of this thread */
+  TimerDuration blocked_since; /**< @brief When the thread went to sleep, or 0 if it is not sleeping */
+  enum SCHED_CAUSE blocked_cause; /**< @brief The cause of the current sleep */
+
+#ifndef NVALGRIND
+  unsigned valgrind_stack_id; /**< @brief Valgrind helper for stacks. 
+    This is useful in order to register the thread stack to the valgrind memory profiler. 
+    Valgrind needs to know which parts of memory are used as stacks, in order to return
+    meaningful error information. 
+    This field is not relevant to anything in the TinyOS logic.
+    */
+#endif
+
+} TCB;
+
+/** @brief Thread stack size.
+  The default thread stack size in TinyOS is 128 kbytes.
+ */
+#define THREAD_STACK_SIZE (128 * 1024)
+
+/** @brief Smallest thread stack size accepted by @c spawn_thread() */
+#define THREAD_STACK_MIN (16 * 1024)
+
+/** @brief Largest thread stack size accepted by @c spawn_thread() */
+#define THREAD_STACK_MAX (8 * 1024 * 1024)
+
+/************************
+ *
+ *      Scheduler
+ *
+ ************************/
+
+/** @brief Number of priority levels of the multilevel feedback queue.
+  Higher levels are scheduled first.
+ */
+#define SCHED_QUEUES 10
+
+/** @brief Log2 of the length of a timer wheel tick, in microseconds (1 tick = 1024 usec). */
+#define TIMER_TICK_SHIFT 10
+
+/** @brief Log2 of the number of slots in each level of the timer wheel. */
+#define TIMER_WHEEL_BITS 6
+
+/** @brief Number of slots in each level of the timer wheel. */
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+
+/** @brief Number of levels of the timer wheel. 
+  Timeouts further than @c TIMER_WHEEL_SLOTS^TIMER_WHEEL_LEVELS ticks ahead 
+  (about 4.7 hours) wait in an overflow list.
+  */
+#define TIMER_WHEEL_LEVELS 4
+
+/** @brief Queue node of an MCS lock.
+  Each core that waits for (or holds) an MCS lock provides its own node, 
+  and spins only on the @c locked flag of that node. Nodes are aligned
+  to a cache line, so that waiters do not disturb each other.
+ */
+typedef struct mcs_node {
+  struct mcs_node* volatile next; /**< @brief The next waiter in the queue */
+  volatile int locked;            /**< @brief Set while the owner of the node must wait */
+} __attribute__((aligned(64))) McsNode;
+
+/** @brief A queued (MCS) spinlock.
+  Waiters are served in FIFO order, and a handoff touches only the cache 
+  lines of the two nodes involved. This is used for the scheduler locks, 
+  which are always taken with preemption off. 
+  @see McsLock_Lock
+ */
+typedef struct mcs_lock {
+  McsNode* volatile tail; /**< @brief The last waiter, or NULL if the lock is free */
+} McsLock;
+
+/** @brief Initializer for an unlocked @c McsLock */
+#define MCS_LOCK_INIT ((McsLock){ NULL })
+
+/** @brief Core control block.
+  Per-core info in memory (basically scheduler-related). 
+  Each core owns a multilevel set of ready queues and a timer wheel, both
+  protected by the core's @c sched_lock. A thread is owned by the core
+  stored in @c TCB::core, and its scheduling state may only be changed
+  while holding that core's lock. The one exception is a wakeup from 
+  another core, which moves a @c STOPPED thread to @c READY atomically,
+  and leaves it in the owner's @c inbox to be queued.
+ */
+typedef struct core_control_block {
+  uint id; /**< @brief The core id */
+
+  TCB* current_thread; /**< @brief Points to the thread currently owning the core */
+  uintptr_t current_handle; /**< @brief The handle of @c current_thread, see @c sched_handle_running() */
+  TCB* previous_thread; /**< @brief Points to the thread that previously owned the core */
+  volatile unsigned long switches; /**< @brief Context switches of this core, see @c cur_thread_fast() */
+  TCB idle_thread; /**< @brief Used by the scheduler to handle the core's idle thread */
+
+  McsLock sched_lock; /**< @brief Spinlock for the run queues and timeouts of this core */
+  McsNode sched_lock_node[MAX_CORES]; /**< @brief Queue nodes of this core, one for the 
+                                            @c sched_lock of each core */
+  volatile uint ready_count; /**< @brief Number of queued threads, read racily by idle peers */
+
+  /* The ready queues of the MLFQ class */
+  rlnode ready_queue[SCHED_QUEUES]; /**< @brief The ready queues. The top level is always the last 
+                                          one, the others rotate by @c boost_base */
+  uint ready_mask; /**< @brief Bit @c i is set iff priority level @c i has ready threads */
+  uint boost_base; /**< @brief Rotation of the lower levels in @c ready_queue */
+  uint yield_counter; /**< @brief Yields since the last priority boost */
+
+  /* The ready queue of the fair class */
+  TCB* fair_root; /**< @brief Root of the pairing heap of ready threads, by @c vruntime */
+  TimerDuration min_vruntime; /**< @brief The least @c vruntime of this core; never decreases */
+
+  /* The ready queues of the real-time class */
+  rlnode rt_queue[RT_PRIORITIES]; /**< @brief Ready @c RT_FIFO threads, by priority */
+  uint rt_mask; /**< @brief Bit @c i is set iff @c rt_queue[i] is not empty */
+  rlnode rt_edf; /**< @brief Ready @c RT_EDF threads, by deadline */
+  uint rt_count; /**< @brief Number of ready real-time threads */
+  TimerDuration rt_window; /**< @brief Start of the current real-time throttling window */
+  TimerDuration rt_runtime; /**< @brief Time used by real-time threads in the window */
+  volatile uint rt_util; /**< @brief Sum of the utilizations of the admitted @c RT_EDF threads, 
+                               in millionths */
+
+  /* The ready queue of the gang class */
+  rlnode gang_queue; /**< @brief Ready threads of gang-scheduled processes, in FIFO order */
+  uint gang_count; /**< @brief Number of threads in @c gang_queue */
+
+  TimerDuration slice_start; /**< @brief When the current thread was switched in */
+
+  unsigned long lat_runq[SCHEDINFO_BUCKETS]; /**< @brief Histogram of the ready queue wait 
+                                                  of the threads run here, see @c schedinfo */
+  unsigned long lat_wake[SCHEDINFO_BUCKETS]; /**< @brief Histogram of the wakeup to run time
+                                                  of the threads run here, see @c schedinfo */
+
+  /* Threads owned by this core, sleeping with a timeout */
+  rlnode timer_wheel[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS]; /**< @brief Hierarchical timer wheel of sleeping threads */
+  uint64_t timer_mask[TIMER_WHEEL_LEVELS]; /**< @brief Non-empty slots of each level (may contain stale bits) */
+  rlnode timer_overflow; /**< @brief Threads whose timeout is beyond the range of the wheel */
+  TimerDuration timer_tick; /**< @brief The next tick to expire; all earlier ticks are done */
+  int tickless; /**< @brief Set when the core timer is not armed for a quantum, because 
+                      no other thread competes for the core */
+
+  TCB* volatile inbox; /**< @brief Threads woken up by other cores, not yet queued. This is a 
+                             lock-free stack, pushed by any core and emptied by the owner */
+  int requeue; /**< @brief Set when the current thread was made ready by this core, 
+                     on its way out; then @c gain() must queue it */
+  TCB* handoff; /**< @brief The last thread queued here by a wakeup from the current thread,
+                      while it is still queued; it runs next if the current thread blocks */
+
+  TCB* thread_cache; /**< @brief Free thread blocks (stack + TCB) kept for reuse, linked through their first word */
+  uint thread_cache_count; /**< @brief Number of blocks in @c thread_cache */
+
+} CCB;
+
+/** @brief the array of Core Control Blocks (CCB) for the kernel */
+extern CCB cctx[MAX_CORES];
+
+/** @brief A scheduler class.
+  The policy that orders the ready threads of a core. The generic scheduler
+  keeps the ready count, the affinity, the wakeup inbox and the timeouts, 
+  and calls the hooks with the lock of @c ccb held. Each core has its own
+  ready queues in the class, stored in its @c CCB. 
+  @see boot_sched_policy
+ */
+typedef struct sched_class {
+  const char* name; /**< @brief Name of the policy */
+  void (*init)(CCB* ccb); /**< @brief Set up empty ready queues for @c ccb */
+  void (*enqueue)(CCB* ccb, TCB* tcb); /**< @brief Add a ready thread */
+  void (*dequeue)(CCB* ccb, TCB* tcb); /**< @brief Remove a queued thread */
+  TCB* (*pick_next)(CCB* ccb); /**< @brief Remove and return the next thread to run, or NULL */
+  TCB* (*steal)(CCB* victim, CCB* ccb); /**< @brief Remove and return a thread of @c victim 
+                                              that may run on @c ccb, or NULL */
+  void (*tick)(CCB* ccb, TCB* tcb, enum SCHED_CAUSE cause, TimerDuration ran); /**< @brief 
+        The current thread @c tcb leaves the core after running for @c ran usec (optional) */
+  void (*on_block)(CCB* ccb, TCB* tcb, enum SCHED_CAUSE cause); /**< @brief The current 
+        thread @c tcb leaves the core to sleep (optional) */
+  void (*migrate)(CCB* from, CCB* to, TCB* tcb); /**< @brief @c tcb, which is not queued, 
+        moves from one core to another (optional) */
+} SchedClass;
+
+/** @brief High-water mark of the per-core cache of free thread blocks.
+  When a thread is released, its memory is kept in the cache of the current
+  core for a later @c spawn_thread(), unless the cache already holds this 
+  many blocks. Set to 0 to disable caching.
+ */
+extern unsigned int thread_cache_limit;
+
+/** @brief Select how thread memory is allocated.
+  If non-zero, the stack and TCB of each thread are mapped with @c mmap(), 
+  with lazy commit and a guard page below the stack, so that a stack
+  overflow causes a segmentation fault. Else, they are allocated with 
+  @c malloc(). This can only be changed while no threads exist, i.e., 
+  before @c boot().
+ */
+extern int mmapped_thread_mem;
+
+
+/** 
+  @brief The current thread.
+  This function returns the TCB of the calling thread. Via this function,
+  a system call can identify the process executing it, and all other information.
+  For performance reasons, it is advised to call this function
+  only once in each system call.
+  @returns a pointer to the TCB of the caller.
+*/
+TCB* cur_thread();
+
+/**
+  @brief The current thread, without disabling preemption.
+  This returns the same as @c cur_thread(), but it does not turn preemption
+  off and on, which costs two system calls of the host. It is meant for 
+  hot paths such as @c Mutex_Lock. It may return NULL before the scheduler
+  has started.
+  @returns a pointer to the TCB of the caller.
+*/
+TCB* cur_thread_fast();
+
+/**
+  @brief Check if a thread is running on some core.
+  The thread is given by its handle (see @c TCB::handle), so it may be a 
+  thread that has exited. The answer may be stale by the time it is 
+  returned, thus it is only a hint, for example to decide whether to spin
+  on a lock that the thread holds.
+  @param handle the handle of the thread
+  @returns 1 if the thread was running, 0 otherwise
+*/
+int sched_handle_running(uintptr_t handle);
+
+/** 
+  @brief The current process.
+  This is a pointer to the PCB of the owner process of the current thread, 
+  i.e., the thread currently executing on this core.
+*/
+#define CURPROC (cur_thread()->owner_pcb)
+
+/**
+  @brief A timeout constant, denoting no timeout for sleep.
+*/
+#define NO_TIMEOUT ((TimerDuration)-1)
+
+/**
+  @brief Create a new thread.
+  This call creates a new thread, initializing and returning its TCB.
+  The thread will belong to process @c pcb and execute @c func.
+    Note that, the new thread is returned in the @c INIT state.
+    The caller must use @c wakeup() to start it.
+    @param pcb  The process control block of the owning process. The
+                scheduler simply stores this value in the new TCB, and
+                otherwise ignores it
+    @param func The function to execute in the new thread.
+    @param stack_size The stack size of the new thread, or 0 for @c THREAD_STACK_SIZE.
+                It is rounded up to whole pages, and clamped between 
+                @c THREAD_STACK_MIN and @c THREAD_STACK_MAX.
+    @returns  A pointer to the TCB of the new thread, in the @c INIT state.
+*/
+TCB* spawn_thread(PCB* pcb, void (*func)(), size_t stack_size);
+
+/**
+  @brief Wakeup a blocked thread.
+  This call will change the state of a thread from @c STOPPED or @c INIT (where the
+  thread is blocked) to @c READY. 
+  @param tcb the thread to be made @c READY.
+  @returns 1 if the thread state was @c STOPPED or @c INIT, 0 otherwise
+*/
+int wakeup(TCB* tcb);
+
+/** 
+  @brief Block the current thread.
+  This call will block the current thread, changing its state to @c STOPPED
+  or @c EXITED. Also, the mutex @c mx, if not `NULL`, will be unlocked, atomically
+  with the blocking of the thread. 
+  In particular, what is meant by 'atomically' is that the thread state will change
+  to @c newstate atomically with the mutex unlocking. Note that, the state of
+  the current thread is @c RUNNING. 
+  Therefore, no other state change (such as a wakeup, a yield, another sleep etc) 
+  can happen "between" the thread's state change and the unlocking.
+  
+  If the @c newstate is @c EXITED, the thread will block and also will eventually be
+  cleaned-up by the scheduler. Its TCB should not be accessed in any way after this
+  call.
+  A cause for the sleep must be provided; this parameter indicates to the scheduler the
+  source of the sleeping operation, and can be used in scheduler heuristics to adjust 
+  scheduling decisions.
+  A timeout can also be provided. If the timeout is not @c NO_TIMEOUT, then the thread will
+  be made ready by the scheduler after the timeout duration has passed, even without a call to
+  @c wakeup() by another thread.
+  @param newstate the new state for the current thread, which must be either stopped or exited
+  @param mx the mutex to unlock.
+  @param cause the cause of the sleep
+  @param timeout a timeout for the sleep, or 
+   */
+void sleep_releasing(Thread_state newstate, Mutex* mx, enum SCHED_CAUSE cause, TimerDuration timeout);
+
+/**
+  @brief Lend a priority to a thread.
+  This is used for priority inheritance: a thread about to block on a 
+  @c Mutex lends its priority to the owner, so that the owner is not 
+  starved by threads of lower priority than the waiter, while the waiter
+  is blocked. If the thread is queued, it moves to the queue of its new
+  priority. Lending a priority lower than the current one has no effect.
+
+  The owner is given by its handle, as stored in the @c Mutex word. The 
+  owner may have exited while holding the mutex, so the handle is looked 
+  up in the table of live threads; a handle that is not found, because its
+  thread exited, is ignored. Handles are never reused, so a lookup never
+  finds a new thread that took over the memory of the owner.
+
+  The priority is lent on behalf of @c lock, and it is given back when 
+  the owner unlocks @c lock. Thus, an owner of nested mutexes keeps the 
+  priorities lent on the outer ones while it releases the inner ones.
+  @param owner the handle of the thread that inherits the priority
+  @param priority the priority to lend
+  @param lock the mutex that the lender waits for
+  @see sched_restore_priority
+*/
+void sched_inherit_priority(uintptr_t owner, int priority, Mutex* lock);
+
+/**
+  @brief Give back the priority inherited on a mutex.
+  This drops the priority that the current thread inherited by 
+  @c sched_inherit_priority() on @c lock. The thread falls back to the 
+  highest priority still lent on the other mutexes it holds, or to its 
+  own. It is called when a @c Mutex with blocked waiters is unlocked. 
+  @param tcb the current thread
+  @param lock the mutex that is unlocked
+*/
+void sched_restore_priority(TCB* tcb, Mutex* lock);
+
+/**
+  @brief Set the cores a thread may run on.
+  A queued thread on a core outside @c mask moves to the least loaded 
+  core in @c mask at once; a running or sleeping thread moves when it 
+  is next queued. To move right away, the current thread should yield()
+  once it has released its locks.
+  @param tcb the thread
+  @param mask the allowed cores, containing at least one existing core
+  @returns 1 if @c tcb is on a core outside @c mask, else 0
+  @see SetAffinity
+*/
+int sched_set_affinity(TCB* tcb, coremask_t mask);
+
+/** @brief Length of the real-time throttling window, in usec */
+#define RT_PERIOD 100000
+
+/** @brief Time that real-time threads may use in each window of a core, in usec */
+#define RT_RUNTIME 95000
+
+/**
+  @brief Change the real-time policy of a thread.
+  The slice of the current thread knows nothing of its new policy. It 
+  should yield() once it has released its locks, to move to the core that
+  admitted it, and start a slice bounded by its budget.
+  @param tcb the thread
+  @param params valid real-time parameters
+  @returns 0 on success, or -1 if an @c RT_EDF thread cannot be admitted
+  @see SetRealtime
+*/
+int sched_set_realtime(TCB* tcb, const rt_params* params);
+
+/**
+  @brief Gang-schedule a thread with the other threads of its process, or stop.
+  @param tcb the thread
+  @param gang non-zero to gang-schedule
+  @see SetGang
+*/
+void sched_set_gang(TCB* tcb, int gang);
+
+/**
+  @brief Close the gang slot of a process, if it holds the current one.
+
+  The slot keeps a plain pointer to the PCB. This must be called when
+  no thread of @c pcb is left in the gang queues, that is, when its last
+  thread exits or when it leaves the gang, before the PCB can be reused.
+  @param pcb the process
+  @see SetGang
+*/
+void sched_gang_release(PCB* pcb);
+
+/**
+  @brief Copy the latency histograms of a core.
+  @param core an existing core
+  @param info filled with the histograms of @c core
+  @see OpenSchedInfo
+*/
+void sched_latency_read(uint core, schedinfo* info);
+
+/**
+  @brief Add the CPU accounting of @c stats to @c sum.
+*/
+void sched_stats_add(sched_stats* sum, const sched_stats* stats);
+
+/**
+  @brief Move the CPU accounting of the current thread to @c sum, as it exits.
+  This includes the part of the current time-slice that has run so far,
+  which @c yield() would only add to the TCB, after it is of no use.
+  The accounting of the thread then starts over, so a later call moves
+  only what the thread did since this one.
+*/
+void sched_stats_exit(sched_stats* sum);
+
+/**
+  @brief Give up the CPU.
+  This call asks the scheduler to terminate the quantum of the current thread
+  and possibly switch to a different thread. The scheduler may decide that 
+  it will renew the quantum for the current thread.
+ */
+void yield(enum SCHED_CAUSE cause);
+
+/**
+  @brief Enter the scheduler.
+  This function is called at kernel initialization, by each core,
+  to enter the scheduler. When this function returns, the scheduler
+  has stopped (there are no more active threads) and the 
+*/
+void run_scheduler(void);
+
+/**
+  @brief Initialize the scheduler.
+   This function is called during kernel initialization.
+ */
+void initialize_scheduler(void);
+
+/**
+  @brief Quantum (in microseconds) 
+  This is the default quantum for each thread, in microseconds.
+  */
+#define QUANTUM (10000L)
+
+/**
+  @brief Shortest time-slice (in microseconds) 
+  A thread gets a time-slice of twice its average CPU burst, within
+  @c QUANTUM_MIN and @c QUANTUM_MAX. Threads that block soon get short
+  slices, and threads that use up their slices get longer ones.
+  */
+#define QUANTUM_MIN (QUANTUM/5)
+
+/** @brief Longest time-slice (in microseconds), see @c QUANTUM_MIN */
+#define QUANTUM_MAX (4*QUANTUM)
+
+
+/**
+  @brief Scheduler event tracing.
+
+  When this is defined, each core records its scheduler events in a ring
+  holding the last @c SCHED_TRACE_EVENTS of them: the cause of every 
+  @c yield(), every context switch in @c gain(), every @c wakeup(), every
+  @c sleep_releasing() and every expired timeout, stamped by @c bios_clock().
+  At shutdown, the rings are written to @c SCHED_TRACE_FILE in the Chrome 
+  trace format, which chrome://tracing and Perfetto (ui.perfetto.dev) open.
+  Each core is a track, showing the threads it ran as slices, and the other
+  events as instants.
+
+  Uncomment, or add -DSCHED_TRACE to CFLAGS, to enable.
+ */
+//#define SCHED_TRACE
+
+#ifdef SCHED_TRACE
+
+/** @brief Number of events kept per core; a power of 2. */
+#define SCHED_TRACE_EVENTS 16384
+
+#ifndef SCHED_TRACE_FILE
+/** @brief The file the trace is written to, see @c SCHED_TRACE */
+#define SCHED_TRACE_FILE "sched_trace.json"
+#endif
+
+/** @brief Write the events of all cores to @c SCHED_TRACE_FILE. */
+void sched_trace_dump();
+
+#endif
+
+/** @} */
+
+#endif
\ No newline at end of file
@@ -9,6 +9,9 @@
 SCB* PORTMAP[MAX_PORT];
 static int first_call = 1;
 
+// protects PORTMAP; locked before the lock of any SCB
+static Mutex portmap_lock = MUTEX_INIT;
+
 file_ops socket_file_ops = {
 	.Open  = NULL,
 	.Read  = socket_read,
@@ -31,18 +34,21 @@ Fid_t sys_Socket(port_t port)
 		return NOFILE;
 
 	// if this is the first time we call sys_Socket , initialize the port map
+	Mutex_Lock(&portmap_lock);
 	if (first_call) {
 		for (int i=0; i < MAX_PORT; i++) {
 			PORTMAP[i] = NULL;
 		}
 		first_call--;
 	}
+	Mutex_Unlock(&portmap_lock);
 
 	/*NEW SCB*/
 	// create the SCB
 	SCB* socket_cb = (SCB*)xmalloc(sizeof(SCB));
 
 	// initialize new socket control blocks' fields
+	socket_cb->lock 	= MUTEX_INIT;
 	socket_cb->fcb  	= fcb;
 	socket_cb->type 	= SOCKET_UNBOUND;
 	socket_cb->port 	= port;
@@ -75,13 +81,17 @@ int sys_Listen(Fid_t sock)
 	if (p_scb == NULL)
 		return -1;
 
+	int retval = -1;
+	Mutex_Lock(&portmap_lock);
+	Mutex_Lock(&p_scb->lock);
+
 	// port and socket inspection
 	if(PORTMAP[p_scb->port] != NULL)	// socket is already initialized
-		return -1;
+		goto finish;
 	if(p_scb->port <= 0 || p_scb->port > MAX_PORT)	// socket must have a legal port number
-		return -1;
+		goto finish;
 	if(p_scb->type != SOCKET_UNBOUND)	// socket already a listener
-		return -1;
+		goto finish;
 
 	// adjust socket fields and union
 	p_scb->type = SOCKET_LISTENER;
@@ -90,8 +100,12 @@ int sys_Listen(Fid_t sock)
 
 	// bind socket to port
 	PORTMAP[p_scb->port] = p_scb;
+	retval = 0;
 
-	return 0;
+finish:
+	Mutex_Unlock(&p_scb->lock);
+	Mutex_Unlock(&portmap_lock);
+	return retval;
 }
 
 
@@ -131,10 +145,16 @@ Fid_t sys_Accept(Fid_t lsock)
 		return NOFILE;
 	if (p_scb->port <= NOPORT || p_scb->port > MAX_PORT)
 		return NOFILE;
-	if (p_scb->type != SOCKET_LISTENER)
-		return NOFILE;
-	if ( ( PORTMAP[p_scb->port] )->type != SOCKET_LISTENER )
+
+	/* The listener lock is held while inspecting the queue; PORTMAP entries
+	   are only cleared with it held, so they can be read under it too. */
+	Mutex_Lock(&p_scb->lock);
+
+	if (p_scb->type != SOCKET_LISTENER || PORTMAP[p_scb->port] == NULL
+		|| ( PORTMAP[p_scb->port] )->type != SOCKET_LISTENER ) {
+		Mutex_Unlock(&p_scb->lock);
 		return NOFILE;
+	}
 
 
 	// INCREASE REFERENCE COUNT
@@ -144,38 +164,35 @@ Fid_t sys_Accept(Fid_t lsock)
 	while ( rlist_len(&p_scb->s_listener.queue) == 0 ){
 
 		//check whether listener is still alive
-		if ( PORTMAP[p_scb->port] == NULL ) 
+		if ( PORTMAP[p_scb->port] == NULL ) {
+			Mutex_Unlock(&p_scb->lock);
 			return NOFILE;
+		}
 
-		kernel_wait(&p_scb->s_listener.req_available, SCHED_IO);
+		kernel_wait(&p_scb->lock, &p_scb->s_listener.req_available, SCHED_IO);
 
 	}
 
 	/* ESTABLISH CONNECTION */
 	CONNECTION_REQUEST* request = rlist_pop_front(&p_scb->s_listener.queue)->connection_request;
 
-	request->admitted = 1;
+	/* The connecting thread sleeps until admitted, so the peers can be 
+	   set up without the listener lock (sys_Socket takes other locks). */
+	Mutex_Unlock(&p_scb->lock);
 
 	// get peer 1 from connection
 	SCB* peer1 = request->peer;
 
-	if(peer1 == NULL) 
-		return NOFILE;
-
 	//create a socket with port from peer 1
-	Fid_t desc = sys_Socket(peer1->port);
-	if (desc == NOFILE)
-		return NOFILE;
-
-	FCB* f = get_fcb(desc);
-
-	if(f == NULL)
-		return NOFILE;
-
-	SCB* peer2 = f->streamobj;
-
-	if(peer2 == NULL)
-		return NOFILE;
+	Fid_t desc = (peer1 != NULL) ? sys_Socket(peer1->port) : NOFILE;
+	FCB* f = (desc != NOFILE) ? get_fcb(desc) : NULL;
+	SCB* peer2 = (f != NULL) ? f->streamobj : NULL;
+
+	// the connecting thread waits for us; refuse the request
+	if(peer2 == NULL) {
+		desc = NOFILE;
+		goto finish;
+	}
 
 	peer1->type = SOCKET_PEER;
 	peer2->type = SOCKET_PEER;
@@ -201,6 +218,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	// PIPE 1)
 	pipe1->reader = t_fs1;
 	pipe1->writer = t_fs2;
+	pipe1->lock = MUTEX_INIT;
 
 	pipe1->has_space = COND_INIT;
 	pipe1->has_data = COND_INIT;
@@ -210,6 +228,7 @@ Fid_t sys_Accept(Fid_t lsock)
 	// PIPE 2)
 	pipe2->reader = t_fs2;
 	pipe2->writer = t_fs1;
+	pipe2->lock = MUTEX_INIT;
 
 	pipe2->has_space = COND_INIT;
 	pipe2->has_data = COND_INIT;
@@ -223,10 +242,15 @@ Fid_t sys_Accept(Fid_t lsock)
 	peer2->s_peer.write = pipe2;
 	peer2->s_peer.read  = pipe1;
 
+finish:
+	Mutex_Lock(&p_scb->lock);
+	request->admitted = (desc != NOFILE) ? 1 : -1;
 	kernel_signal(&request->connected_cv);
 	p_scb->refcount--;
+	int last = (p_scb->refcount == 0);
+	Mutex_Unlock(&p_scb->lock);
 
-	if (p_scb->refcount == 0)
+	if (last)
 		free(p_scb);
 
 	return desc;
@@ -251,12 +275,25 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 		return -1;
 	if (port < 0 || port > MAX_PORT)
 		return -1;
-	if (PORTMAP[port] == NULL) 
-		return -1;
+
+	// INCREASE REFERENCE COUNT (of the connecting socket)
+	Mutex_Lock(&p_socket->lock);
+	p_socket->refcount++;
+	Mutex_Unlock(&p_socket->lock);
+
+	int retval = -1;
+	Mutex_Lock(&portmap_lock);
+	if (PORTMAP[port] == NULL) {
+		Mutex_Unlock(&portmap_lock);
+		goto finish;
+	}
 
 	/* Establish the connection */
-	CONNECTION_REQUEST* request = (CONNECTION_REQUEST*)xmalloc(sizeof(CONNECTION_REQUEST));
 	SCB* listener = PORTMAP[port];
+	Mutex_Lock(&listener->lock);
+	Mutex_Unlock(&portmap_lock);
+
+	CONNECTION_REQUEST* request = (CONNECTION_REQUEST*)xmalloc(sizeof(CONNECTION_REQUEST));
 
 	//init request
 	request->admitted = 0;
@@ -272,22 +309,41 @@ int sys_Connect(Fid_t sock, port_t port, timeout_t timeout)
 
 	listener->refcount++;
 	
-	while (!request->admitted) {
-		int retval = kernel_timedwait(&request->connected_cv, SCHED_IO, timeout);
+	while (request->admitted == 0) {
+		// timeout is in msec, kernel_timedwait expects usec
+		int signalled = kernel_timedwait(&listener->lock, &request->connected_cv, SCHED_IO, timeout*1000ul);
 		
-		// request timed out
-		if(!retval)
-			return -1;
+		// request timed out: withdraw it, unless Accept has taken it and 
+		// will admit or refuse it shortly
+		if(!signalled && request->admitted == 0
+			&& rlist_find(&listener->s_listener.queue, request, NULL) != NULL) {
+			rlist_remove(&request->queue_node);
+			break;
+		}
 	}
 
+	if ( request->admitted > 0 )
+		retval = 0;
+
+	listener->refcount--;
+	int last_listener = (listener->refcount == 0);
+	Mutex_Unlock(&listener->lock);
+
+	// Accept no longer touches the request
+	free(request);
+	if (last_listener)
+		free(listener);
+
+finish:
+	Mutex_Lock(&p_socket->lock);
 	p_socket->refcount--;
-	if( p_socket->refcount == 0 )
-		free(p_socket);
+	int last = (p_socket->refcount == 0);
+	Mutex_Unlock(&p_socket->lock);
 
-	if ( request->admitted == 0 )
-		return -1;
+	if( last )
+		free(p_socket);
 
-	return 0;
+	return retval;
 }
 
 
@@ -312,9 +368,12 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 	if (p_socket == NULL)
 		return -1;
 
+	int retval = -1;
+	Mutex_Lock(&p_socket->lock);
+
 	// shut down can only be used on a peer socket
 	if (p_socket->type != SOCKET_PEER)
-		return -1;
+		goto finish;
 
 
 
@@ -322,28 +381,30 @@ int sys_ShutDown(Fid_t sock, shutdown_mode how)
 
 		case SHUTDOWN_READ:
 			if( pipe_reader_close(p_socket->s_peer.read) != 0 )
-				return -1;
+				goto finish;
 			p_socket->s_peer.read = NULL;
 			break;
 		case SHUTDOWN_WRITE:
 			if( pipe_writer_close(p_socket->s_peer.write) != 0 )
-				return -1;
+				goto finish;
 			p_socket->s_peer.write = NULL;
 			break;
 		case SHUTDOWN_BOTH:
 			int r1 = pipe_writer_close(p_socket->s_peer.write);
 			int r2 = pipe_reader_close(p_socket->s_peer.read);
 			if( r1 == -1 || r2 == -1 )
-				return -1;
+				goto finish;
 			p_socket->s_peer.read  = NULL;
 			p_socket->s_peer.write = NULL;
 			break;
 
 	}
 	
+	retval = 0;
 
-
-	return 0;
+finish:
+	Mutex_Unlock(&p_socket->lock);
+	return retval;
 }
 
 
@@ -358,14 +419,17 @@ int socket_read(void* read, char* buf, uint size){
 	if (scb == NULL)
 		return -1;
 
-	if (scb->type != SOCKET_PEER || scb->s_peer.peer == NULL)
-		return -1;
+	/* Do not hold the socket lock while blocked in the pipe */
+	Mutex_Lock(&scb->lock);
+	pipe_cb* pipe = (scb->type == SOCKET_PEER && scb->s_peer.peer != NULL) 
+		? scb->s_peer.read : NULL;
+	Mutex_Unlock(&scb->lock);
 
 	//probably not necessary
-	if (scb->s_peer.read == NULL)
+	if (pipe == NULL)
 		return -1;
 
-	int retval = pipe_read(scb->s_peer.read, buf, size);
+	int retval = pipe_read(pipe, buf, size);
 
 	return retval;
 }
@@ -377,14 +441,17 @@ int socket_write(void* write, const char* buf, uint size){
 	if(scb == NULL)
 		return -1;
 
-	if (scb->type != SOCKET_PEER || scb->s_peer.peer == NULL)
-		return -1;
+	/* Do not hold the socket lock while blocked in the pipe */
+	Mutex_Lock(&scb->lock);
+	pipe_cb* pipe = (scb->type == SOCKET_PEER && scb->s_peer.peer != NULL) 
+		? scb->s_peer.write : NULL;
+	Mutex_Unlock(&scb->lock);
 
 	// PROBABLY NOT NESSECARY
-	if (scb->s_peer.write == NULL)
+	if (pipe == NULL)
 		return -1;
 
-	int retval = pipe_write(scb->s_peer.write, buf, size);
+	int retval = pipe_write(pipe, buf, size);
 
 	return retval;
 }
@@ -398,9 +465,15 @@ int socket_close(void* scb){
 	if (p_socket == NULL)
 		return -1;
 
+	Mutex_Lock(&portmap_lock);
+	Mutex_Lock(&p_socket->lock);
+
 	if (p_socket->type == SOCKET_PEER) {
-		if ( !(pipe_writer_close(p_socket->s_peer.write) || pipe_reader_close(p_socket->s_peer.read)) )
+		if ( !(pipe_writer_close(p_socket->s_peer.write) || pipe_reader_close(p_socket->s_peer.read)) ) {
+			Mutex_Unlock(&p_socket->lock);
+			Mutex_Unlock(&portmap_lock);
 			return -1;
+		}
 		p_socket->s_peer.peer = NULL;
 	}
 
@@ -414,6 +487,9 @@ int socket_close(void* scb){
 
 	p_socket->refcount--;
 
+	Mutex_Unlock(&p_socket->lock);
+	Mutex_Unlock(&portmap_lock);
+
 	//if (!p_socket->refcount)
 		//free(p_socket);
 
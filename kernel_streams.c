@@ -0,0 +1,324 @@
+
+#include "util.h"
+#include "tinyos.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+
+#define MAX_FILES MAX_PROC
+
+FCB FT[MAX_FILES];
+rlnode FCB_freelist;
+
+/* Protects FCB_freelist */
+static Mutex FT_lock = MUTEX_INIT;
+
+
+void initialize_files()
+{
+  rlnode_init(&FCB_freelist,NULL);
+  for(int i=0;i<MAX_FILES;i++) {
+
+    FT[i].refcount = 0;
+    rlnode_init(& FT[i].freelist_node, &FT[i]);
+    rlist_push_back(&FCB_freelist, & FT[i].freelist_node);
+  }
+}
+
+
+FCB* acquire_FCB()
+{
+  FCB* fcb = NULL;
+
+  Mutex_Lock(&FT_lock);
+  if(! is_rlist_empty(& FCB_freelist)) {
+    fcb = rlist_pop_front(& FCB_freelist)->fcb;
+    fcb->refcount = 0;
+  }
+  Mutex_Unlock(&FT_lock);
+
+  return fcb;
+}
+
+void release_FCB(FCB* fcb)
+{
+  Mutex_Lock(&FT_lock);
+  rlist_push_back(& FCB_freelist, & fcb->freelist_node);
+  Mutex_Unlock(&FT_lock);
+}
+
+
+/*
+  The reference count is the only mutable state of an FCB shared between
+  processes, so it is updated atomically instead of under a lock.
+ */
+void FCB_incref(FCB* fcb)
+{
+  assert(fcb);
+  __atomic_add_fetch(&fcb->refcount, 1, __ATOMIC_RELAXED);
+}
+
+int FCB_decref(FCB* fcb)
+{
+  assert(fcb);
+  if(__atomic_sub_fetch(&fcb->refcount, 1, __ATOMIC_ACQ_REL)==0) {
+    int retval = fcb->streamfunc->Close(fcb->streamobj);
+    release_FCB(fcb);
+    return retval;
+  }
+  else
+    return 0;
+}
+
+
+
+int FCB_reserve(size_t num, Fid_t *fid, FCB** fcb)
+{
+    PCB* cur = CURPROC;
+    size_t f=0;
+    uint i;
+
+    Mutex_Lock(&cur->lock);
+
+    /* Find distinct fids */
+    for(i=0; i<num; i++) {
+	while(f<MAX_FILEID && cur->FIDT[f]!=NULL)
+	    f++;
+	if(f==MAX_FILEID) break;
+	fid[i] = f; f++;
+    }
+    if(i<num) goto fail;
+    /* Allocate FCBs */
+    for(i=0;i<num;i++)
+	if((fcb[i] = acquire_FCB()) == NULL)
+	    break;
+    if(i<num) {
+	/* Roll back */
+	while(i>0) {
+	    release_FCB(fcb[i-1]);
+	    i--;
+	}
+	goto fail;
+    }
+    /* Found all */
+    for(i=0;i<num;i++) {
+	cur->FIDT[fid[i]]=fcb[i];
+	FCB_incref(fcb[i]);
+    }
+    Mutex_Unlock(&cur->lock);
+    return 1;
+
+fail:
+    Mutex_Unlock(&cur->lock);
+    return 0;
+}
+
+
+
+void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb)
+{
+    PCB* cur = CURPROC;
+    Mutex_Lock(&cur->lock);
+    for(size_t i=0; i<num ; i++) {
+	assert(cur->FIDT[fid[i]]==fcb[i]);
+	cur->FIDT[fid[i]] = NULL;
+	release_FCB(fcb[i]);
+    }
+    Mutex_Unlock(&cur->lock);
+}
+
+
+
+
+
+
+/*
+ *
+ *   I/O routines
+ *
+ */
+
+
+FCB* get_fcb(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  return CURPROC->FIDT[fid];
+}
+
+
+FCB* get_fcb_ref(Fid_t fid)
+{
+  if(fid < 0 || fid >= MAX_FILEID) return NULL;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fid];
+  if(fcb) FCB_incref(fcb);
+  Mutex_Unlock(&cur->lock);
+
+  return fcb;
+}
+
+
+int sys_Read(Fid_t fd, char *buf, unsigned int size)
+{
+  int retcode = -1;
+  int (*devread)(void*,char*,uint);
+  void* sobj;
+
+  
+  /* Get the fields from the stream, holding a reference so that the
+     stream is not closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+    sobj = fcb->streamobj;
+    devread = fcb->streamfunc->Read;
+  
+    if(devread)
+      retcode = devread(sobj, buf, size);
+
+    /* Need to decrease the reference to FCB */
+    FCB_decref(fcb);
+  }
+  
+
+
+  return retcode;
+}
+
+
+int sys_Write(Fid_t fd, const char *buf, unsigned int size)
+{
+  int retcode = -1;
+  int (*devwrite)(void*, const char*, uint) = NULL;
+  void* sobj = NULL;
+
+  
+  /* Get the fields from the stream, holding a reference so that the
+     stream is not closed (by another thread) while we are using it! */
+  FCB* fcb = get_fcb_ref(fd);
+
+  if(fcb) {
+
+    sobj = fcb->streamobj;
+    devwrite = fcb->streamfunc->Write;
+  
+
+    if(devwrite)
+      retcode = devwrite(sobj, buf, size);
+
+    /* Need to decrease the reference to FCB */
+    FCB_decref(fcb);
+
+  }
+
+
+  return retcode;
+}
+
+
+int sys_Close(int fd)
+{
+  int retcode = (fd>=0 && fd<MAX_FILEID) ? 0 : -1;  /* Closing a closed fd is legal! */
+
+  if(retcode != 0)
+    return retcode;
+
+  /* Detach the fid under the PCB lock, but close outside of it */
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+  FCB* fcb = cur->FIDT[fd];
+  cur->FIDT[fd] = NULL;
+  Mutex_Unlock(&cur->lock);
+
+  if(fcb) {
+    retcode = FCB_decref(fcb);    
+  }
+
+  return retcode;
+}
+
+
+/*
+  Copy file descriptor oldfd into file descriptor newfd.
+
+  This call returns 0 on success and -1 on failure.
+  Possible reasons for failure:
+  - Either oldfd or newfd is invalid.
+ */
+int sys_Dup2(int oldfd, int newfd)
+{
+  int retcode=0;
+  if(oldfd<0 || newfd<0 || oldfd>=MAX_FILEID || newfd>=MAX_FILEID)
+    return -1;
+
+  PCB* cur = CURPROC;
+  Mutex_Lock(&cur->lock);
+
+  FCB* old = cur->FIDT[oldfd];
+  FCB* new = cur->FIDT[newfd];
+
+  if(old==NULL) {
+    retcode = -1;
+  }
+  else if(old!=new) {
+    FCB_incref(old);
+    cur->FIDT[newfd] = old;
+  }
+
+  Mutex_Unlock(&cur->lock);
+
+  /* The replaced stream is closed outside of the PCB lock */
+  if(old!=NULL && old!=new && new!=NULL)
+    FCB_decref(new);
+
+  return retcode;
+}
+
+
+
+unsigned int sys_GetTerminalDevices()
+{
+  return device_no(DEV_SERIAL);
+}
+
+
+/**
+  Open a stream for the given device.
+  */
+Fid_t open_stream(Device_type major, unsigned int minor)
+{
+  Fid_t fid;
+  FCB* fcb;
+
+
+  if(! FCB_reserve(1, &fid, &fcb))
+      goto finerr;
+  
+  if(device_open(major, minor, & fcb->streamobj, &fcb->streamfunc)) {
+      FCB_unreserve(1, &fid, &fcb);
+      goto finerr;
+  }
+  
+  goto finok;
+finerr:
+  fid = NOFILE;
+finok:
+  return fid;
+}
+
+
+int sys_OpenNull()
+{
+  return open_stream(DEV_NULL, 0);
+}
+
+
+Fid_t sys_OpenTerminal(unsigned int termno)
+{
+  return open_stream(DEV_SERIAL, termno);
+}
+
@@ -128,6 +128,19 @@ void FCB_unreserve(size_t num, Fid_t *fid, FCB** fcb);
 FCB* get_fcb(Fid_t fid);
 
 
+/** @brief Translate an fid to an FCB, holding a reference to it.
+
+	This is like @ref get_fcb, but the lookup and the increase of the 
+	reference count happen atomically under the PCB lock, so the stream 
+	cannot be closed by another thread before the caller is done with it.
+	The caller must release the reference with @ref FCB_decref.
+
+	@param fid the file ID to translate to a pointer to FCB
+	@returns a pointer to the corresponding FCB, or NULL.
+ */
+FCB* get_fcb_ref(Fid_t fid);
+
+
 /** @} */
 
 #endif
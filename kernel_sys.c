@@ -0,0 +1,48 @@
+
+#include "tinyos.h"
+#include "kernel_sys.h"
+#include "kernel_cc.h"
+
+#ifndef NVALGRIND
+#include <valgrind/valgrind.h>
+#endif
+
+/*
+	Define all the syscalls 
+ */
+
+
+/*
+	There is no kernel-wide lock around system calls. Each system call 
+	locks the kernel objects it touches (see kernel_cc.h).
+ */
+#define PRE_CALL
+
+
+
+#define POST_CALL
+
+
+/* with return */
+#define SYSCALL(NAME, RET, SIG, ARGS)\
+RET NAME SIG \
+{\
+	RET __ret;\
+	PRE_CALL\
+	__ret = sys_##NAME ARGS;\
+	POST_CALL\
+	return __ret;\
+}\
+
+/* without return */
+#define SYSCALLV(NAME, SIG, ARGS)\
+void NAME SIG \
+{\
+	PRE_CALL\
+	sys_##NAME ARGS;\
+	POST_CALL\
+}\
+
+
+SYSCALLS
+
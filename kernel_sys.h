@@ -11,10 +11,14 @@ SYSCALL(GetPid, int, (void), ())\
 SYSCALL(GetPPid, int, (void), ())\
 SYSCALL(WaitChild, Pid_t, (Pid_t proc, int* exitval), (proc, exitval))\
 SYSCALL(CreateThread, Tid_t, (Task task, int argl, void* args), (task, argl, args))\
+SYSCALL(CreateThreadEx, Tid_t, (Task task, int argl, void* args, unsigned int stack_size), (task, argl, args, stack_size))\
 SYSCALL(ThreadSelf, Tid_t, (void), ())\
 SYSCALL(ThreadJoin, int, (Tid_t tid, int* exitval), (tid, exitval))\
 SYSCALL(ThreadDetach, int, (Tid_t tid), (tid))\
 SYSCALLV(ThreadExit, (int exitval), (exitval))\
+SYSCALL(SetAffinity, int, (Tid_t tid, coremask_t mask), (tid, mask))\
+SYSCALL(SetRealtime, int, (Tid_t tid, const rt_params* params), (tid, params))\
+SYSCALL(SetGang, int, (int on), (on))\
 SYSCALL(GetTerminalDevices, unsigned int, (), ())\
 SYSCALL(OpenTerminal, Fid_t, (unsigned int termno), (termno))\
 SYSCALL(OpenNull, Fid_t, (), ())\
@@ -29,6 +33,18 @@ SYSCALL(Accept, Fid_t, (Fid_t lsock), (lsock))\
 SYSCALL(Connect, int, (Fid_t sock, port_t port, timeout_t timeout), (sock, port, timeout))\
 SYSCALL(ShutDown, int, (Fid_t sock, shutdown_mode how), (sock, how))\
 SYSCALL(OpenInfo, Fid_t, (), ())\
+SYSCALL(OpenSchedInfo, Fid_t, (), ())\
+SYSCALL(FutexWait, int, (int* addr, int val), (addr, val))\
+SYSCALL(FutexWake, int, (int* addr, int count), (addr, count))\
+SYSCALLV(RWLock_ReadLock, (RWLock* rw), (rw))\
+SYSCALL(RWLock_TimedReadLock, int, (RWLock* rw, timeout_t timeout), (rw, timeout))\
+SYSCALLV(RWLock_ReadUnlock, (RWLock* rw), (rw))\
+SYSCALLV(RWLock_WriteLock, (RWLock* rw), (rw))\
+SYSCALL(RWLock_TimedWriteLock, int, (RWLock* rw, timeout_t timeout), (rw, timeout))\
+SYSCALLV(RWLock_WriteUnlock, (RWLock* rw), (rw))\
+SYSCALLV(Sem_Wait, (Semaphore* sem), (sem))\
+SYSCALL(Sem_TimedWait, int, (Semaphore* sem, timeout_t timeout), (sem, timeout))\
+SYSCALLV(Sem_Post, (Semaphore* sem), (sem))\
 
 
 
@@ -0,0 +1,381 @@
+#include "tinyos.h"
+#include "kernel_sched.h"
+#include "kernel_proc.h"
+#include "kernel_cc.h"
+#include "kernel_streams.h"
+
+
+/** 
+  @brief Create a new thread in the current process, with a given stack size.
+  Initialize the ptcb and make the new thread READY.
+  */
+Tid_t sys_CreateThreadEx(Task task, int argl, void* args, unsigned int stack_size)
+{
+
+  TCB* tcb; //Initialization of a thread (TCB)
+  PCB* curproc = CURPROC;
+
+  /*
+    When we initialize a thread we have to spawn a new thread, thus we add 
+    a new thread in the current process . We do that by calling a function
+    called : start_main_ptcb_thread 
+  */
+  tcb = spawn_thread(curproc, start_main_ptcb_thread, stack_size);
+
+  Mutex_Lock(&curproc->lock);
+  acquire_ptcb(tcb, task, argl, args); // We acquire a ptcb with our new thread pointing at it 
+  
+  curproc->thread_count++;  // Since we created a thread we add 1 to the count
+  Mutex_Unlock(&curproc->lock);
+  
+  wakeup(tcb);  // thread becomes ready
+
+  return (Tid_t)tcb->ptcb;
+  
+}
+
+
+/** 
+  @brief Create a new thread in the current process.
+  The thread gets the default stack size.
+  */
+Tid_t sys_CreateThread(Task task, int argl, void* args)
+{
+  return sys_CreateThreadEx(task, argl, args, 0);
+}
+
+
+
+
+/**
+  @brief Return the Tid of the current thread.
+ */
+Tid_t sys_ThreadSelf()
+{
+  return (Tid_t)cur_thread()->ptcb;
+}
+
+
+
+/**
+  @brief Join the given thread.
+  When the current thread is in RUNNING state, it stops running
+  and waits until the given thread ends
+  */
+int sys_ThreadJoin(Tid_t tid, int* exitval)
+{
+
+  PTCB* ptcb = (PTCB*) tid;
+  PCB* curproc = CURPROC;
+  int retval = -1;
+
+  Mutex_Lock(&curproc->lock);
+
+  if(rlist_find(&curproc->ptcb_list, ptcb, NULL) == NULL){
+
+    //if we find that the current ptcb list doesnt contain the thread we exit
+    goto finish;
+  }
+
+
+  if(cur_thread()->ptcb == ptcb){
+
+    //When the cuurent thread joins itself we exit
+    goto finish;
+  }
+
+  if(ptcb->detached == 1){
+
+    //If the joined thread is detached, it canNOT be joined
+    goto finish;
+  }
+
+  // as multiple threads can join each time we call threadJoin, we must store how many so we can free the memory of each one 
+  increase_refcount(ptcb); 
+
+
+
+  while((ptcb->detached != 1) && (ptcb->exited != 1)) {
+
+    // putting curthread to SLEEP state at the exit condvar of the joined thread and unlocking curthreads mutex
+    kernel_wait(&curproc->lock, &(ptcb->exit_cv), SCHED_USER);  
+
+  }
+
+
+  decrease_refcount(ptcb);
+
+
+  if(ptcb->detached == 1){
+
+    //If the thread got detached while the curthread is waiting return -1
+    goto finish;
+  }
+
+  if(exitval != NULL){
+    *exitval = ptcb->exitval; //while the exit status is not NULL get the new exit status of the joined thread 
+  }
+
+  // After everything was successfull we free up the memory used for the joined thread
+  if(ptcb->refcount == 1){
+    rlist_remove(&(ptcb->ptcb_list_node)); //When the refcount is 1 we must remove the ptcb
+    free(ptcb);  
+
+  }
+
+  retval = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return retval;
+}
+
+
+
+
+/**
+  @brief Detach the given thread.
+  When a joined thread gets detached all the threads "sleeping" on its exit cv
+  must get signaled and thus ready to start running again
+  */
+int sys_ThreadDetach(Tid_t tid)
+{
+  PTCB* ptcb = (PTCB*)tid; 
+  PCB* curproc = CURPROC;
+  int retval = -1;
+
+  Mutex_Lock(&curproc->lock);
+
+  if(rlist_find(&curproc->ptcb_list, ptcb, NULL) == NULL){ 
+
+    goto finish;
+  }
+
+
+
+  if(ptcb->exited == 1){
+
+    goto finish;
+  }
+
+
+  ptcb->detached = 1;
+
+
+  kernel_broadcast(&ptcb->exit_cv);
+
+  retval = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+  return retval;
+}
+
+
+/**
+  @brief Restrict the cores of the given thread.
+  The PCB lock keeps the thread from exiting (and its TCB from being 
+  released) while the scheduler moves it.
+  */
+int sys_SetAffinity(Tid_t tid, coremask_t mask)
+{
+  PCB* curproc = CURPROC;
+  PTCB* ptcb = (tid == NOTHREAD) ? cur_thread()->ptcb : (PTCB*) tid;
+  int retval = -1;
+  int move = 0;
+
+  /* Ignore the cores that do not exist */
+  if(cpu_cores() < 32)
+    mask &= (1u << cpu_cores()) - 1;
+  if(mask == 0)
+    return -1;
+
+  Mutex_Lock(&curproc->lock);
+
+  if(rlist_find(&curproc->ptcb_list, ptcb, NULL) == NULL){
+    goto finish;
+  }
+
+  if(ptcb->exited == 1){
+    goto finish;
+  }
+
+  move = sched_set_affinity(ptcb->tcb, mask) && ptcb == cur_thread()->ptcb;
+  retval = 0;
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+
+  /* Move to an allowed core now; we must not yield holding the PCB lock */
+  if(move)
+    yield(SCHED_USER);
+  return retval;
+}
+
+
+/**
+  @brief Change the real-time policy of the given thread.
+  As in @c sys_SetAffinity, the PCB lock keeps the thread from exiting.
+  */
+int sys_SetRealtime(Tid_t tid, const rt_params* params)
+{
+  PCB* curproc = CURPROC;
+  PTCB* ptcb = (tid == NOTHREAD) ? cur_thread()->ptcb : (PTCB*) tid;
+  int retval = -1;
+
+  if(params == NULL)
+    return -1;
+
+  switch(params->policy){
+    case RT_NONE:
+      break;
+    case RT_FIFO:
+      if(params->priority < 0 || params->priority >= RT_PRIORITIES)
+        return -1;
+      break;
+    case RT_EDF:
+      if(params->period == 0 || params->budget == 0 || params->budget > params->period)
+        return -1;
+      break;
+    default:
+      return -1;
+  }
+
+  Mutex_Lock(&curproc->lock);
+
+  if(rlist_find(&curproc->ptcb_list, ptcb, NULL) == NULL){
+    goto finish;
+  }
+
+  if(ptcb->exited == 1){
+    goto finish;
+  }
+
+  retval = sched_set_realtime(ptcb->tcb, params);
+
+finish:
+  Mutex_Unlock(&curproc->lock);
+
+  /* As in sys_SetAffinity, start a slice of the new policy once unlocked */
+  if(retval == 0 && ptcb == cur_thread()->ptcb)
+    yield(SCHED_USER);
+  return retval;
+}
+
+
+
+
+/**
+  @brief Terminate the current thread.
+  */
+void sys_ThreadExit(int exitval)
+{
+
+  PTCB* ptcb = cur_thread()->ptcb;
+  PCB* curproc = CURPROC;
+
+  Mutex_Lock(&curproc->lock);
+
+  ptcb->exitval = exitval; 
+  ptcb->exited = 1;
+
+  /* procinfo stops counting our TCB now; keep our CPU accounting in the PCB */
+  sched_stats_exit(&curproc->stats);
+
+  // the thread is exited thus we unlock the mutex for the next thread to lock it and start running
+  kernel_broadcast(&(ptcb->exit_cv)); 
+
+  curproc->thread_count--;
+
+  /* 
+    If other threads remain, the process lives on. Our PTCB may be freed
+    by a joiner as soon as the PCB lock is released, so release it only
+    once we are off the CPU.
+   */
+  if(curproc->thread_count != 0)
+    kernel_sleep(&curproc->lock, EXITED, SCHED_USER);
+
+  /* Clean up PTCB list nodes*/
+
+  while(!is_rlist_empty(&curproc->ptcb_list)){
+
+    rlnode* ptcb_node;
+    ptcb_node = rlist_pop_front(&curproc->ptcb_list);
+    free(ptcb_node->ptcb);
+  }
+
+  /* 
+    We are the last thread. Nobody else touches the PCB of this process
+    except through the process table, so we can drop its lock. The PTCBs
+    are freed above, under the lock, because procinfo walks the list.
+   */
+  Mutex_Unlock(&curproc->lock);
+
+  /* Our gang slot must not outlive the PCB, which will be reused */
+  if(curproc->gang)
+    sched_gang_release(curproc);
+
+  /* 
+    Do all the other cleanup we want here, close files etc. 
+   */
+
+  /* Release the args data */
+  if(curproc->args) {
+    free(curproc->args);
+    curproc->args = NULL;
+  }
+
+  /* Clean up FIDT */
+  for(int i=0;i<MAX_FILEID;i++) {
+    if(curproc->FIDT[i] != NULL) {
+      FCB_decref(curproc->FIDT[i]);
+      curproc->FIDT[i] = NULL;
+    }
+  }
+
+  Mutex_Lock(&proc_table_lock);
+
+  if(get_pid(curproc) != 1){
+  /* Reparent any children of the exiting process to the 
+     initial task */
+    PCB* initpcb = get_pcb(1);
+    while(!is_rlist_empty(& curproc->children_list)) {
+      rlnode* child = rlist_pop_front(& curproc->children_list);
+      child->pcb->parent = initpcb;
+      rlist_push_front(& initpcb->children_list, child);
+    }
+
+    /* Add exited children to the initial task's exited list 
+       and signal the initial task */
+    if(!is_rlist_empty(& curproc->exited_list)) {
+      rlist_append(& initpcb->exited_list, &curproc->exited_list);
+      kernel_broadcast(& initpcb->child_exit);
+    }
+
+    /* Put me into my parent's exited list */
+    rlist_push_front(& curproc->parent->exited_list, &curproc->exited_node);
+    kernel_broadcast(& curproc->parent->child_exit);
+
+  }
+
+  assert(is_rlist_empty(& curproc->children_list));
+  assert(is_rlist_empty(& curproc->exited_list));
+
+
+  /* Disconnect my main_thread */
+  curproc->main_thread = NULL;
+
+  /* Now, mark the process as exited. */
+  curproc->pstate = ZOMBIE;
+
+  /* 
+    Add our CPU accounting since we exited, that is, the cleanup above.
+    procinfo reads it under proc_table_lock, which we hold.
+   */
+  sched_stats_exit(&curproc->stats);
+
+
+  /* Bye-bye cruel world; our parent may reap us once we are off the CPU */
+  kernel_sleep(&proc_table_lock, EXITED, SCHED_USER);
+
+}
@@ -0,0 +1,124 @@
+
+#include <assert.h>
+
+#include "tinyos.h"
+#include "kernel_sched.h"
+#include "unit_testing.h"
+
+/*
+	Tests of the kernel, beside those of validate_api. They link with 
+	the kernel like validate_api. Some look at kernel internals that the 
+	system call API does not show, such as the TCB of the current thread.
+ */
+
+
+static Mutex pi_mx = MUTEX_INIT;
+static CondVar pi_cv = COND_INIT;
+static int pi_waiting, pi_signalled;
+
+static int pi_owner(int argl, void* args)
+{
+	Mutex_Lock(&pi_mx);
+	pi_waiting = 1;
+	while(! pi_signalled)
+		Cond_Wait(&pi_mx, &pi_cv);
+
+	/* We hold pi_mx again, having relocked it after a wait morph */
+	TCB* cur = cur_thread();
+	cur->priority = 0;
+	*(int*)args = 1;
+
+	TimerDuration deadline = bios_clock() + 1000000;
+	while(cur->pi_count == 0 && bios_clock() < deadline)
+		yield(SCHED_USER);
+
+	int boosted = cur->pi_count == 1 && cur->pi_boost[0].lock == &pi_mx
+		&& cur->priority > 0;
+	Mutex_Unlock(&pi_mx);
+
+	return boosted;
+}
+
+static int pi_contender(int argl, void* args)
+{
+	Mutex_Lock(&pi_mx);
+	Mutex_Unlock(&pi_mx);
+	return 0;
+}
+
+BOOT_TEST(test_cond_relock_inherits_priority,
+	"Test that a thread that relocks its mutex after a wait morph is boosted by a contender",
+	.timeout = 5
+	)
+{
+	pi_waiting = pi_signalled = 0;
+	int reacquired = 0;
+	Tid_t owner = CreateThread(pi_owner, 0, &reacquired);
+
+	/* Signal with pi_mx held, so that the owner is morphed onto it */
+	Mutex_Lock(&pi_mx);
+	while(! pi_waiting) {
+		Mutex_Unlock(&pi_mx);
+		yield(SCHED_USER);
+		Mutex_Lock(&pi_mx);
+	}
+	pi_signalled = 1;
+	Cond_Signal(&pi_cv);
+	Mutex_Unlock(&pi_mx);
+
+	while(! __atomic_load_n(&reacquired, __ATOMIC_ACQUIRE))
+		yield(SCHED_USER);
+	Tid_t contender = CreateThread(pi_contender, 0, NULL);
+
+	int boosted;
+	ASSERT(ThreadJoin(owner, &boosted)==0);
+	ASSERT(ThreadJoin(contender, NULL)==0);
+	ASSERT(boosted);
+	return 0;
+}
+
+
+static int connect_late(int argl, void* args)
+{
+	Fid_t cli = Socket(NOPORT);
+	return Connect(cli, 100, 1000);
+}
+
+BOOT_TEST(test_accept_after_connect_timeout,
+	"Test that Accept skips a connection request that timed out, and serves the next one",
+	.timeout = 5
+	)
+{
+	Fid_t lsock = Socket(100);
+	ASSERT(lsock!=NOFILE);
+	ASSERT(Listen(lsock)==0);
+
+	/* The request of cli times out; it must not be left in the queue */
+	Fid_t cli = Socket(NOPORT);
+	ASSERT(Connect(cli, 100, 10)==-1);
+	ASSERT(Close(cli)==0);
+
+	Tid_t t = CreateThread(connect_late, 0, NULL);
+	Fid_t srv = Accept(lsock);
+	ASSERT(srv!=NOFILE);
+
+	int connected;
+	ASSERT(ThreadJoin(t, &connected)==0);
+	ASSERT(connected==0);
+	return 0;
+}
+
+
+TEST_SUITE(kernel_tests, "Tests of the kernel")
+{
+	&test_cond_relock_inherits_priority,
+	&test_accept_after_connect_timeout,
+	NULL
+};
+
+
+int main(int argc, char** argv)
+{
+	return register_test(&kernel_tests) ||
+		run_program(argc, argv, &kernel_tests);
+}